@@ -26,6 +26,11 @@ MsDosTime inline last_modified_time(fs::path path)
     auto t2 = to_time(t1);
     return MsDosTime(t2);
 }
+inline string lower(string str)
+{
+    transform(str.begin(), str.end(), str.begin(), [](char c) { return static_cast<char>(tolower(c)); });
+    return str;
+}
 
 
 void print_help()
@@ -33,7 +38,18 @@ void print_help()
     cout << "help document:" << endl;
     cout << "=======================" << endl;
     cout << endl;
-    cout << "    `nyaszip.exe [in1 [in2 [in3 ...]]] [-o out]`" << endl;
+    cout << "    `nyaszip.exe [in1 [in2 [in3 ...]]] [-o out] [options]`" << endl;
+    cout << endl;
+    cout << "    -o, --out <out>    the output zip file, \"-\" for writing into stdout (streaming)" << endl;
+    cout << "    -z, --gzip         transplant the deflate data of single-member *.gz files into" << endl;
+    cout << "                       entries without the \".gz\" instead of recompressing them" << endl;
+    cout << "    -s, --sink <sink>  how the zip file is written: \"stream\" (ofstream), \"fd\" (write/pwrite, default on POSIX)," << endl;
+    cout << "                       \"uring\" (io_uring with several blocks in flight, linux)," << endl;
+    cout << "                       \"direct\" (O_DIRECT, bypass the page cache)," << endl;
+    cout << "                       \"mmap\" (preallocate the estimated size and map the file)" << endl;
+    cout << "    -a, --align <n>    pad the stored files without password, so their data starts at" << endl;
+    cout << "                       the multiple of n bytes (like 4096), for using them in place by mmap" << endl;
+    cout << "    -h, --help         show this document" << endl;
 }
 
 void _build_test_zip()
@@ -72,12 +88,65 @@ void _build_test_zip()
     zip.close();
 }
 
+#ifdef NYASZIP_IO_URING
+Task _write_test_coroutine(LocalFile & file, string const& data)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        co_await file.async_write(reinterpret_cast<u8 const*>(data.data()), data.size());
+    }
+}
+Task _close_test_coroutine(Zip & zip)
+{
+    co_await zip.async_close_current();
+}
 
-/// @return (zip file name, input paths)
-tuple<string, list<string>> process_input(int argc, char ** argv)
+/// @brief two coroutines awaiting the same zip: the second one gets `WaitingException`, the first one is not dropped
+void _test_waiting_coroutines()
+{
+    string data(3 * 1024 * 1024, '\0');
+    u32 x = 1;
+    for (char & c : data) { x = x * 1103515245 + 12345; c = static_cast<char>(x >> 16); }
+
+    Zip zip(*new UringSink("nyastestcoroutines.zip", 2), true);
+    LocalFile & file = zip.add("random.bin");
+    Task writing = _write_test_coroutine(file, data);
+    Task closing = _close_test_coroutine(zip);
+    writing.start();    // suspended, the blocks are in flight
+    closing.start();
+    try
+    {
+        closing.get();
+        cout << "the second coroutine is not rejected" << endl;
+    }
+    catch (Zip::WaitingException const& err)
+    {
+        cout << "the second coroutine is rejected: " << err.what() << endl;
+    }
+
+    while (!writing.done()) { zip.poll(); }
+    writing.get();
+    Task close = zip.async_close();
+    close.start();
+    while (!close.done()) { zip.poll(); }
+    close.get();
+    cout << "the first coroutine is finished, good: " << zip.good() << endl;
+}
+#endif
+
+
+struct Options
 {
     string zip = "";
-    list<string> files;
+    list<string> paths;
+    bool gzip = false;  // transplant gzip files
+    string sink = "";   // empty for the default
+    u16 alignment = 0;  // of stored files, 0 for not aligned
+};
+
+Options process_input(int argc, char ** argv)
+{
+    Options options;
 
     int idx = 1;
     while (idx < argc)
@@ -89,9 +158,35 @@ tuple<string, list<string>> process_input(int argc, char ** argv)
             idx++;
             if (idx < argc)
             {
-                zip = argv[idx];
+                options.zip = argv[idx];
             }
         }
+        else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--sink") == 0)
+        {
+            idx++;
+            if (idx < argc)
+            {
+                options.sink = lower(argv[idx]);
+            }
+        }
+        else if (strcmp(arg, "-a") == 0 || strcmp(arg, "--align") == 0)
+        {
+            idx++;
+            if (idx < argc)
+            {
+                unsigned long alignment = strtoul(argv[idx], nullptr, 10);
+                if (alignment > 32768 || (alignment & (alignment - 1)) != 0)
+                {
+                    cerr << "invalid alignment: \"" << argv[idx] << "\", expected 0 or a power of 2 not greater than 32768" << endl;
+                    exit(1);
+                }
+                options.alignment = static_cast<u16>(alignment);
+            }
+        }
+        else if (strcmp(arg, "-z") == 0 || strcmp(arg, "--gzip") == 0)
+        {
+            options.gzip = true;
+        }
         else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0)
         {
             print_help();
@@ -99,12 +194,12 @@ tuple<string, list<string>> process_input(int argc, char ** argv)
         }
         else
         {
-            files.push_back(arg);
+            options.paths.push_back(arg);
         }
         idx++;
     }
 
-    return {zip, files};
+    return options;
 }
 
 
@@ -122,6 +217,313 @@ public:
     }
 };
 
+/// @brief walk through a raw deflate stream (RFC 1951) without producing the output,
+///        to find where the stream ends and the length of the uncompressed data
+class deflatescanner
+{
+public:
+    struct InvalidDeflateException : public std::exception
+    {
+        virtual char const* what() const noexcept override
+        {
+            return "invalid deflate stream";
+        }
+    };
+
+protected:
+    static constexpr u16 LENGTH_BASE[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static constexpr u8 LENGTH_EXTRA[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+    };
+    static constexpr u16 DISTANCE_BASE[30] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+    };
+    static constexpr u8 DISTANCE_EXTRA[30] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+    };
+
+    struct Huffman
+    {
+        static constexpr u8 FAST_BITS = 9;
+
+        u16 count[16];              // the number of codes of each length
+        u16 symbol[288];            // symbols ordered by their codes
+        u16 fast[1 << FAST_BITS];   // (length << 12 | symbol) indexed by the next bits, 0 if the code is longer
+
+        void build(u8 const* lengths, u16 n)
+        {
+            memset(count, 0, sizeof(count));
+            memset(fast, 0, sizeof(fast));
+            for (u16 s = 0; s < n; s++) { count[lengths[s]]++; }
+            count[0] = 0;
+
+            i32 left = 1;
+            for (u8 len = 1; len < 16; len++)
+            {
+                left = (left << 1) - count[len];
+                if (left < 0) { throw InvalidDeflateException(); }  // over-subscribed
+            }
+
+            u16 offsets[16] = {0};
+            for (u8 len = 1; len < 15; len++) { offsets[len + 1] = offsets[len] + count[len]; }
+            for (u16 s = 0; s < n; s++)
+            {
+                if (lengths[s] != 0) { symbol[offsets[lengths[s]]++] = s; }
+            }
+
+            // canonical codes are assigned in the order of `symbol`, and packed from their msb
+            u32 code = 0;
+            u16 index = 0;
+            for (u8 len = 1; len <= FAST_BITS; len++)
+            {
+                for (u16 k = 0; k < count[len]; k++, code++, index++)
+                {
+                    u32 reversed = 0;
+                    for (u8 b = 0; b < len; b++) { reversed |= ((code >> b) & 1) << (len - 1 - b); }
+                    for (u32 next = reversed; next < (1u << FAST_BITS); next += 1u << len)
+                    {
+                        fast[next] = static_cast<u16>(len << 12 | symbol[index]);
+                    }
+                }
+                code <<= 1;
+            }
+        }
+    };
+
+    istream & _in;
+    u64 _bits;      // bit buffer, lsb first
+    u8 _nbits;
+    u64 _read;      // the bytes taken into the bit buffer
+    u64 _padding;   // the zero bytes taken after the end of input, only allowed in looking ahead
+    u64 _uncompressed;
+    Huffman _fixed_length;
+    Huffman _fixed_distance;
+
+    void _need(u8 n)
+    {
+        while (_nbits < n)
+        {
+            auto c = _in.rdbuf()->sbumpc();
+            if (c == char_traits<char>::eof())
+            {
+                if (++_padding > 8) { throw InvalidDeflateException(); }
+                c = 0;
+            }
+            _bits |= static_cast<u64>(static_cast<u8>(c)) << _nbits;
+            _nbits += 8;
+            _read++;
+        }
+    }
+    u32 _take(u8 n)
+    {
+        _need(n);
+        u32 value = static_cast<u32>(_bits & ((static_cast<u64>(1) << n) - 1));
+        _bits >>= n;
+        _nbits -= n;
+        return value;
+    }
+    u16 _decode(Huffman const& h)
+    {
+        _need(Huffman::FAST_BITS);
+        if (u16 entry = h.fast[_bits & ((1u << Huffman::FAST_BITS) - 1)]; entry != 0)
+        {
+            _bits >>= entry >> 12;
+            _nbits -= entry >> 12;
+            return entry & 0x0FFF;
+        }
+        // codes longer than FAST_BITS, decode bit by bit
+        i32 code = 0, first = 0, index = 0;
+        for (u8 len = 1; len < 16; len++)
+        {
+            code |= _take(1);
+            i32 count = h.count[len];
+            if (code - count < first)
+            {
+                return h.symbol[index + (code - first)];
+            }
+            index += count;
+            first = (first + count) << 1;
+            code <<= 1;
+        }
+        throw InvalidDeflateException();
+    }
+
+    void _stored()
+    {
+        _bits >>= _nbits & 7;
+        _nbits -= _nbits & 7;
+        u32 length = _take(16);
+        if ((length ^ 0xFFFF) != _take(16)) { throw InvalidDeflateException(); }
+        _uncompressed += length;
+
+        for (; length != 0 && _nbits != 0; length--) { _take(8); }
+        _in.ignore(length);
+        if (static_cast<u32>(_in.gcount()) != length) { throw InvalidDeflateException(); }
+        _read += length;
+    }
+    void _codes(Huffman const& length_code, Huffman const& distance_code)
+    {
+        while (true)
+        {
+            u16 sym = _decode(length_code);
+            if (sym < 256)
+            {
+                _uncompressed++;
+                continue;
+            }
+            if (sym == 256) { return; }
+
+            sym -= 257;
+            if (sym >= 29) { throw InvalidDeflateException(); }
+            u32 length = LENGTH_BASE[sym] + _take(LENGTH_EXTRA[sym]);
+            u16 dist = _decode(distance_code);
+            if (dist >= 30 || DISTANCE_BASE[dist] + _take(DISTANCE_EXTRA[dist]) > _uncompressed)
+            {
+                throw InvalidDeflateException();
+            }
+            _uncompressed += length;
+        }
+    }
+    void _dynamic()
+    {
+        static constexpr u8 ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+        u16 nlength = _take(5) + 257, ndistance = _take(5) + 1, ncode = _take(4) + 4;
+        if (nlength > 286 || ndistance > 30) { throw InvalidDeflateException(); }
+
+        u8 lengths[286 + 30] = {0};
+        for (u16 i = 0; i < ncode; i++) { lengths[ORDER[i]] = _take(3); }
+        Huffman length_code;
+        length_code.build(lengths, 19);
+
+        for (u16 i = 0; i < nlength + ndistance; )
+        {
+            u16 sym = _decode(length_code);
+            if (sym < 16)
+            {
+                lengths[i++] = static_cast<u8>(sym);
+                continue;
+            }
+            u8 len = 0;
+            u16 repeat;
+            if (sym == 16)
+            {
+                if (i == 0) { throw InvalidDeflateException(); }
+                len = lengths[i - 1];
+                repeat = 3 + _take(2);
+            }
+            else if (sym == 17) { repeat = 3 + _take(3); }
+            else { repeat = 11 + _take(7); }
+            if (i + repeat > nlength + ndistance) { throw InvalidDeflateException(); }
+            while (repeat--) { lengths[i++] = len; }
+        }
+        if (lengths[256] == 0) { throw InvalidDeflateException(); }
+
+        Huffman distance_code;
+        length_code.build(lengths, nlength);
+        distance_code.build(lengths + nlength, ndistance);
+        _codes(length_code, distance_code);
+    }
+
+public:
+    deflatescanner(istream & in)
+    : _in(in), _bits(0), _nbits(0), _read(0), _padding(0), _uncompressed(0)
+    {
+        u8 lengths[288];
+        for (u16 s = 0; s < 288; s++) { lengths[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8; }
+        _fixed_length.build(lengths, 288);
+        memset(lengths, 5, 30);
+        _fixed_distance.build(lengths, 30);
+    }
+
+    /// @brief scan the deflate stream from the current position of the input
+    /// @return (length of the deflate stream, length of the uncompressed data)
+    tuple<u64, u64> scan()
+    {
+        bool last;
+        do
+        {
+            last = _take(1);
+            switch (_take(2))
+            {
+            case 0: _stored(); break;
+            case 1: _codes(_fixed_length, _fixed_distance); break;
+            case 2: _dynamic(); break;
+            default: throw InvalidDeflateException();
+            }
+        }
+        while (!last);
+
+        // the whole bytes left in the bit buffer are only looked ahead
+        u64 length = _read - _nbits / 8;
+        if (length > _read - _padding) { throw InvalidDeflateException(); }
+        return {length, _uncompressed};
+    }
+};
+
+/// @brief a gzip file (RFC 1952) with exactly one member, its deflate stream can be copied into a zip entry
+struct gzipmember
+{
+    u64 offset;     // the offset of the deflate stream in the file
+    u64 length;     // the length of the deflate stream
+    u32 crc;
+    u64 uncompressed;
+    optional<MsDosTime> modified;
+
+    /// @return nullopt if the file is not a valid gzip file or has more than one member
+    static optional<gzipmember> parse(istream & in, u64 filesize)
+    {
+        u8 header[10];
+        in.read(reinterpret_cast<char *>(header), 10);
+        if (in.gcount() != 10 || header[0] != 0x1F || header[1] != 0x8B || header[2] != 8 /* deflate */ || (header[3] & 0xE0) != 0)
+        {
+            return nullopt;
+        }
+        u8 const flag = header[3];
+        if (flag & 0x04)    // FEXTRA
+        {
+            u8 xlen[2];
+            in.read(reinterpret_cast<char *>(xlen), 2);
+            in.ignore(xlen[0] | xlen[1] << 8);
+        }
+        if (flag & 0x08) { in.ignore(numeric_limits<streamsize>::max(), '\0'); }  // FNAME
+        if (flag & 0x10) { in.ignore(numeric_limits<streamsize>::max(), '\0'); }  // FCOMMENT
+        if (flag & 0x02) { in.ignore(2); }                                         // FHCRC
+        if (!in) { return nullopt; }
+
+        gzipmember member;
+        member.offset = static_cast<u64>(in.tellg());
+        try
+        {
+            auto [length, uncompressed] = deflatescanner(in).scan();
+            member.length = length;
+            member.uncompressed = uncompressed;
+        }
+        catch (deflatescanner::InvalidDeflateException const&)
+        {
+            return nullopt;
+        }
+        // the trailer of the only member ends at the end of file
+        if (member.offset + member.length + 8 != filesize) { return nullopt; }
+
+        u8 trailer[8];
+        in.clear();
+        in.seekg(member.offset + member.length);
+        in.read(reinterpret_cast<char *>(trailer), 8);
+        if (in.gcount() != 8) { return nullopt; }
+        member.crc = trailer[0] | trailer[1] << 8 | trailer[2] << 16 | static_cast<u32>(trailer[3]) << 24;
+        u32 isize  = trailer[4] | trailer[5] << 8 | trailer[6] << 16 | static_cast<u32>(trailer[7]) << 24;
+        if (isize != static_cast<u32>(member.uncompressed)) { return nullopt; }
+
+        u32 mtime = header[4] | header[5] << 8 | header[6] << 16 | static_cast<u32>(header[7]) << 24;
+        if (mtime != 0) { member.modified = MsDosTime(mtime); }
+        return member;
+    }
+};
+
 class nyaszipconfigs
 {
 public:
@@ -131,22 +533,149 @@ public:
         optional<string>    password;
         optional<u16>       AES;
         optional<MsDosTime> modified;
+        optional<u16>       compression;    // compression method
+        optional<u8>        level;
 
         bool empty() const noexcept
         {
-            return !(password.has_value() || AES.has_value() || modified.has_value());
+            return !(password.has_value() || AES.has_value() || modified.has_value() || compression.has_value() || level.has_value());
         }
         bool full() const noexcept
         {
-            return password.has_value() && AES.has_value() && modified.has_value();
+            return password.has_value() && AES.has_value() && modified.has_value() && compression.has_value() && level.has_value();
+        }
+
+        /// @brief set the keys that are not set in this config from `other`
+        void inherit(Config const& other)
+        {
+            if (!password.has_value()    && other.password.has_value())    { password    = other.password; }
+            if (!AES.has_value()         && other.AES.has_value())         { AES         = other.AES; }
+            if (!modified.has_value()    && other.modified.has_value())    { modified    = other.modified; }
+            if (!compression.has_value() && other.compression.has_value()) { compression = other.compression; }
+            if (!level.has_value()       && other.level.has_value())       { level       = other.level; }
         }
     };
 
 protected:
     unordered_map<fs::path, Config> _configs;     // rel path in zip file -> Config
+    unordered_map<fs::path, unordered_map<string, Config>> _ext_configs;  // rel path of directory -> (extension -> Config)
     unordered_map<fs::path, string> _contents;
     unordered_map<fs::path, string> _comments;
 
+    /// @brief describe where the key is set, for the messages
+    static string _where(fs::path const& rel)
+    {
+        return rel.empty() ? "at the root of nyaszip.toml" : "for \"" + rel.generic_string() + "\"";
+    }
+
+    /// @brief parse the inheritable keys, `where` describes the table for the messages of compression and level
+    /// @return false if the key is not inheritable
+    static bool _parse_inheritable(Config & config, string const& key, toml::value const& value, string const& where)
+    {
+        i64 tmp;
+        if (key == "password")
+        {
+            if (value.type() == toml::value_t::string)
+            {
+                config.password = value.as_string();
+            }
+            else if (value.type() == toml::value_t::integer)
+            {
+                tmp = value.as_integer();
+                if (tmp != 0)
+                {
+                    cerr << "should set to 0 to disable password";
+                }
+                config.password = "\xFF";
+            }
+            else
+            {
+                // TODO: more user-friendly message
+                cerr << "got an unsupported type for `password`, expect a string, got " << value.type() << endl;
+            }
+        }
+        else if (key == "AES")
+        {
+            if (value.type() == toml::value_t::integer)
+            {
+                tmp = value.as_integer();
+                if (tmp != 128 && tmp != 192 && tmp != 256)
+                {
+                    cerr << "got an invalid `AES`, expect 128, 192 or 256, got " << tmp << ", reselect as 256" << endl;
+                    tmp = 256;
+                }
+                config.AES = static_cast<u16>(tmp);
+            }
+            else
+            {
+                // TODO: more user-friendly message
+                cerr << "got an unsupported type for `AES`, expect a integer, got " << value.type() << endl;
+            }
+        }
+        else if (key == "modified")
+        {
+            if (value.type() == toml::value_t::local_date
+             || value.type() == toml::value_t::local_datetime
+             || value.type() == toml::value_t::offset_datetime
+            ) {
+                tmp = system_clock::to_time_t(toml::get<system_clock::time_point>(value));
+                config.modified = MsDosTime(tmp);
+            }
+            else
+            {
+                cerr << "got an unsupported type for `modified`, expect a datetime, got " << value.type() << endl;
+            }
+        }
+        else if (key == "compression")
+        {
+            if (value.type() == toml::value_t::string)
+            {
+                string method = lower(value.as_string());
+                if (method == "store")
+                {
+                    config.compression = 0;
+                }
+                else if (method == "bzip2")
+                {
+                    config.compression = BZip2Compression::METHOD;
+                }
+                else
+                {
+                    cerr << "`compression` " << where << " should be \"store\" or \"bzip2\", got \""
+                         << value.as_string() << "\", ignored" << endl;
+                }
+            }
+            else
+            {
+                cerr << "`compression` " << where << " should be the string \"store\" or \"bzip2\", got "
+                     << value.type() << ' ' << value << ", ignored" << endl;
+            }
+        }
+        else if (key == "level")
+        {
+            if (value.type() == toml::value_t::integer)
+            {
+                tmp = value.as_integer();
+                if (tmp < 1 || tmp > 9)
+                {
+                    cerr << "`level` " << where << " should be in [1, 9], got " << tmp << ", 9 is used" << endl;
+                    tmp = 9;
+                }
+                config.level = static_cast<u8>(tmp);
+            }
+            else
+            {
+                cerr << "`level` " << where << " should be an integer in [1, 9], got "
+                     << value.type() << ' ' << value << ", ignored" << endl;
+            }
+        }
+        else
+        {
+            return false;
+        }
+        return true;
+    }
+
 public:
     void add_config_file(fs::path const& root, fs::path const& rel)
     {
@@ -171,63 +700,20 @@ public:
             auto const& [key, value] = entry;
             if (value.type() == toml::value_t::table)
             {
-                add_config(rel / key, value.as_table());
-                continue;
-            }
-
-            i64 tmp;
-            if (key == "password")
-            {
-                if (value.type() == toml::value_t::string)
+                if (key.starts_with("*."))
                 {
-                    config.password = value.as_string();
-                }
-                else if (value.type() == toml::value_t::integer)
-                {
-                    tmp = value.as_integer();
-                    if (tmp != 0)
-                    {
-                        cout << "should set to 0 to disable password";
-                    }
-                    config.password = "\xFF";
+                    add_ext_config(rel, key.substr(1), value.as_table());
                 }
                 else
                 {
-                    // TODO: more user-friendly message
-                    cerr << "got an unsupported type for `password`, expect a string, got " << value.type() << endl;
-                }
-            }
-            else if (key == "AES")
-            {
-                if (value.type() == toml::value_t::integer)
-                {
-                    tmp = value.as_integer();
-                    if (tmp != 128 && tmp != 192 && tmp != 256)
-                    {
-                        cerr << "got an invalid `AES`, expect 128, 192 or 256, got " << tmp << ", reselect as 256" << endl;
-                        tmp = 256;
-                    }
-                    config.AES = static_cast<u16>(tmp);
-                }
-                else
-                {
-                    // TODO: more user-friendly message
-                    cerr << "got an unsupported type for `AES`, expect a integer, got " << value.type() << endl;
+                    add_config(rel / key, value.as_table());
                 }
+                continue;
             }
-            else if (key == "modified")
+
+            if (_parse_inheritable(config, key, value, _where(rel)))
             {
-                if (value.type() == toml::value_t::local_date
-                 || value.type() == toml::value_t::local_datetime
-                 || value.type() == toml::value_t::offset_datetime
-                ) {
-                    tmp = system_clock::to_time_t(toml::get<system_clock::time_point>(value));
-                    config.modified = MsDosTime(tmp);
-                }
-                else
-                {
-                    cerr << "got an unsupported type for `modified`, expect a datetime, got " << value.type() << endl;
-                }
+                continue;
             }
             else if (key == "content")
             {
@@ -266,6 +752,28 @@ public:
         }
     }
 
+    /// @brief the config for all files with extension `ext` (like ".log") in directory `rel` and its subdirectories
+    void add_ext_config(fs::path const& rel, string const& ext, toml::table const& ct)
+    {
+        Config config;
+
+        for (auto const& entry : ct)
+        {
+            auto const& [key, value] = entry;
+            string const where = "for \"*" + ext + "\" in " + (rel.empty() ? "the root" : "\"" + rel.generic_string() + "\"");
+            if (!_parse_inheritable(config, key, value, where))
+            {
+                cerr << "key `" << key << "` " << where << " cannot be set for an extension, expected password, AES, "
+                     << "modified, compression or level, ignored" << endl;
+            }
+        }
+
+        if (!config.empty())
+        {
+            _ext_configs[rel][lower(ext)].inherit(config);
+        }
+    }
+
     unordered_map<fs::path, string> const& contents() const noexcept
     {
         return _contents;
@@ -284,26 +792,23 @@ public:
         {
             config = entry->second;
         }
+        string const ext = lower(rel.extension().string());
         fs::path path = rel;
         while (!config.full() && path.has_relative_path())
         {
             path = path.parent_path();
-            if (auto entry = _configs.find(path); entry != _configs.end())
+            // the extension rules override the directory config at the same level
+            if (auto entry = _ext_configs.find(path); !ext.empty() && entry != _ext_configs.end())
             {
-                Config const& config_ = entry->second;
-                if (!config.password.has_value() && config_.password.has_value())
-                {
-                    config.password = config_.password;
-                }
-                if (!config.AES.has_value() && config_.AES.has_value())
+                if (auto rule = entry->second.find(ext); rule != entry->second.end())
                 {
-                    config.AES = config_.AES;
-                }
-                if (!config.modified.has_value() && config_.modified.has_value())
-                {
-                    config.modified = config_.modified;
+                    config.inherit(rule->second);
                 }
             }
+            if (auto entry = _configs.find(path); entry != _configs.end())
+            {
+                config.inherit(entry->second);
+            }
         }
         return {config, comment};
     }
@@ -314,11 +819,12 @@ class nyaszipbuilder
 public:
     // (rel path, file size, the last modified time), file size = -1 if path is a empty dirctory
     using Path = tuple<fs::path, u64, MsDosTime>;
-    // 3.999GiB, assume other thing in local file data except real file data is less than 1MiB
-    static constexpr u64 THRESHOLD_SIZE = static_cast<u64>(3.999 * 1024 * 1024 * 1024);
 
 protected:
     string _zip_name;
+    string _sink;
+    bool _gzip = false;
+    u16 _alignment = 0;
     nyaszipconfigs _configs;
     unordered_map<fs::path, list<Path>> _paths;
 
@@ -370,7 +876,9 @@ protected:
         }
     }
 
-    LocalFile & _add_file(Zip & zip, fs::path const& rel, u64 filesize, MsDosTime modified = MsDosTime(time(nullptr))) const
+    /// @param zip the `Zip`, or a `StagedZip` for a file that may be dropped
+    template<typename ZipWriter>
+    LocalFile & _add_file(ZipWriter & zip, fs::path const& rel, u64 filesize, MsDosTime modified = MsDosTime(time(nullptr))) const
     {
         auto const [config, comment] = _configs.get(rel);
         LocalFile & file = zip.add(rel.string());
@@ -381,19 +889,176 @@ protected:
         {
             file.external_attribute(FileAttributes::Directory);
         }
-        else if (filesize > THRESHOLD_SIZE)
-        {
-            file.zip64(true);
-        }
         if (auto pswd = config.password.value_or("\xFF"); pswd != "\xFF")
         {
             file.password(pswd, config.AES.value_or(256));
         }
+        if (config.compression.value_or(0) == BZip2Compression::METHOD)
+        {
+            file.bzip2(config.level.value_or(9));
+        }
 
         return file;
     }
 
+    /// @brief copy the file from `in` into `file` until the end, the file may be changed after scanning,
+    /// so the scanned size is not declared
+    static void _copy_file(LocalFile & file, istream & in)
+    {
+        auto buffer = reinterpret_cast<char *>(file.buffer());
+        u64 get_size;
+        do
+        {
+            in.read(buffer, file.buffer_length());
+            get_size = in.gcount();
+            file.flush_buff(get_size);
+        }
+        while (get_size == file.buffer_length());
+    }
+
+    /// @brief copy `length` bytes from `in` into `file`
+    /// @return false if the file is shorter than that (changed after scanning), the written data is incomplete
+    static bool _copy_data(LocalFile & file, istream & in, u64 length)
+    {
+        auto buffer = reinterpret_cast<char *>(file.buffer());
+        for (u64 rest = length; rest != 0; )
+        {
+            u64 get_size = min(rest, file.buffer_length());
+            if (static_cast<u64>(in.read(buffer, get_size).gcount()) != get_size)
+            {
+                return false;
+            }
+            file.flush_buff(get_size);
+            rest -= get_size;
+        }
+        return true;
+    }
+
+    /// @brief copy the deflate stream of a single-member gzip file into the entry named without ".gz"
+    /// @return false if the file cannot be transplanted
+    bool _add_gzip(Zip & zip, fs::path const& root, fs::path const& rel, u64 filesize, MsDosTime modified) const
+    {
+        ifstream in(root / rel, ios::in | ios::binary);
+        if (in.fail()) { return false; }
+        auto const member = gzipmember::parse(in, filesize);
+        if (!member.has_value())
+        {
+            cerr << "cannot transplant " << root / rel << ", it is not a single-member gzip file, add it as is" << endl;
+            return false;
+        }
+
+        // the file may be changed after scanning, then the deflate data cannot be trusted
+        in.clear();
+        in.seekg(0, ios::end);
+        if (in.fail() || static_cast<u64>(in.tellg()) != filesize)
+        {
+            cerr << "cannot transplant " << root / rel << ", it is changed after scanning, add it as is" << endl;
+            return false;
+        }
+
+        // staged, so the entry is dropped (with the `StagedZip`) if the file is changed while copying
+        StagedZip staged(zip);
+        fs::path name = rel.parent_path() / rel.stem();
+        LocalFile & file = _add_file(staged, name, member->uncompressed, member->modified.value_or(modified));
+        file.precompressed(8 /* deflate */, member->crc, member->uncompressed);
+        file.expected_size(member->length);
+
+        in.seekg(member->offset);
+        bool copied = _copy_data(file, in, member->length);
+        if (copied)
+        {
+            in.seekg(0, ios::end);
+            copied = !in.fail() && static_cast<u64>(in.tellg()) == filesize;
+        }
+        if (!copied)
+        {
+            cerr << "cannot transplant " << root / rel << ", it is changed while copying, add it as is" << endl;
+            return false;
+        }
+        staged.commit();
+        return true;
+    }
+
+    /// @brief the length of zip if all files are stored
+    u64 _estimated_length() const
+    {
+        u64 length = 22 /* end of central directory */;
+        auto add = [&](fs::path const& rel, u64 filesize)
+        {
+            u64 name_length = rel.string().size();
+            length += (filesize == static_cast<u64>(-1) ? 0 : filesize) + 2 * name_length + 30 + 46 /* headers */ + 128 /* extras, AES */;
+        };
+        for (auto const& [rel, content] : _configs.contents())
+        {
+            add(rel, content.size());
+        }
+        for (auto const& [root, rels] : _paths)
+        {
+            for (auto const& [rel, filesize, modified] : rels)
+            {
+                add(rel, filesize);
+            }
+        }
+        return length;
+    }
+
+    Zip _create_zip() const
+    {
+        // the stdout is not seekable (if piped), the zip is written in streaming mode
+        if (_zip_name == "-")
+        {
+#ifdef NYASZIP_POSIX
+            return Zip(*new FdSink(STDOUT_FILENO, false), true);
+#else
+            return Zip(cout);
+#endif
+        }
+        if (_sink == "stream")
+        {
+            return Zip(*new ofstream(_zip_name, ios::trunc | ios::binary), true);
+        }
+#ifdef NYASZIP_POSIX
+        if (_sink == "mmap")
+        {
+            return Zip(*new MmapSink(_zip_name, _estimated_length()), true);
+        }
+#endif
+#if defined(NYASZIP_POSIX) && defined(O_DIRECT)
+        if (_sink == "direct")
+        {
+            return Zip(*new DirectSink(_zip_name), true);
+        }
+#endif
+#ifdef NYASZIP_IO_URING
+        if (_sink == "uring")
+        {
+            return Zip(*new UringSink(_zip_name), true);
+        }
+#endif
+        if (!_sink.empty() && _sink != "fd")
+        {
+            cerr << "got an unsupported sink: \"" << _sink << "\", use the default one" << endl;
+        }
+        return Zip::create(_zip_name);
+    }
+
 public:
+    /// @brief the name of sink to write the zip, see `print_help`
+    void sink(string const& name)
+    {
+        _sink = name;
+    }
+    /// @brief transplant single-member gzip files instead of adding them as is
+    void gzip(bool enable = true) noexcept
+    {
+        _gzip = enable;
+    }
+    /// @brief the alignment of data of the stored files without password, 0 for not aligned
+    void alignment(u16 alignment_) noexcept
+    {
+        _alignment = alignment_;
+    }
+
     void prepare(string const& zip_name, list<string> const& paths)
     {
         _zip_name = zip_name;
@@ -455,11 +1120,12 @@ public:
 
     void start()
     {
-        Zip zip = Zip::create(_zip_name);
+        Zip zip = _create_zip();
         if (zip.fail())
         {
             throw ZipCreateFailException(_zip_name);
         }
+        zip.data_alignment(_alignment);
         if (auto comment = get<1>(_configs.get("")); !comment.empty())
         {
             zip.comment(comment);
@@ -468,6 +1134,7 @@ public:
         for (auto const& [rel, content] : _configs.contents())
         {
             LocalFile & file = _add_file(zip, rel, content.size());
+            file.expected_size(content.size());
             file.write(content);
         }
 
@@ -475,24 +1142,25 @@ public:
         {
             for (auto const& [rel, filesize, modified] : rels)
             {
-                LocalFile & file = _add_file(zip, rel, filesize, modified);
-
-                ifstream in(root / rel, ios::in | ios::binary);
-                if (in.fail())
+                if (_gzip && filesize != static_cast<u64>(-1) && lower(rel.extension().string()) == ".gz"
+                 && _add_gzip(zip, root, rel, filesize, modified))
+                {
+                    continue;
+                }
+                if (filesize == static_cast<u64>(-1))
                 {
-                    cerr << "cannot open file: " << root / rel << endl;
+                    _add_file(zip, rel, filesize, modified);
                     continue;
                 }
 
-                auto buffer = reinterpret_cast<char *>(file.buffer());
-                u64 get_size;
-                do
+                ifstream in(root / rel, ios::in | ios::binary);
+                if (in.fail())
                 {
-                    in.read(buffer, file.buffer_length());
-                    get_size = in.gcount();
-                    file.flush_buff(get_size);
+                    cerr << "cannot open file: " << root / rel << ", skip it" << endl;
+                    continue;
                 }
-                while (get_size == file.buffer_length());
+                LocalFile & file = _add_file(zip, rel, filesize, modified);
+                _copy_file(file, in);
             }
         }
 
@@ -514,6 +1182,7 @@ void throweror(std::exception const& err, string const& stage)
 int main(int argc, char ** argv)
 {
     //_build_test_zip();
+    //_test_waiting_coroutines();
 
     if (argc < 2)
     {
@@ -521,12 +1190,15 @@ int main(int argc, char ** argv)
         return 0;
     }
 
-    auto [zip_name, paths] = process_input(argc, argv);
+    Options options = process_input(argc, argv);
     nyaszipbuilder builder;
+    builder.gzip(options.gzip);
+    builder.alignment(options.alignment);
+    builder.sink(options.sink);
 
     try
     {
-        builder.prepare(zip_name, paths);
+        builder.prepare(options.zip, options.paths);
     }
     catch(std::exception const& err)
     {
@@ -6,16 +6,46 @@
 #include <stdint.h>
 #include <algorithm>
 #include <ctime>
+#include <chrono>
+#include <cmath>
 #include <bit>
 #include <array>
 #include <list>
+#include <vector>
+#include <queue>
 #include <tuple>
 #include <string>
+#include <cstring>
+#include <cstdio>
 #include <exception>
 #include <fstream>
+#include <streambuf>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <coroutine>
+#include <new>
+#include <span>
+#include <typeinfo>
+#include <type_traits>
 #ifdef NYASZIP_WARN
 #include <iostream>
 #endif
+#if !defined(NYASZIP_NO_POSIX) && !defined(_WIN32) && __has_include(<unistd.h>)
+#define NYASZIP_POSIX
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define NYASZIP_IO_URING
+#include <atomic>
+#include <unordered_map>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 typedef uint8_t  u8;
 typedef uint16_t u16;
@@ -716,6 +746,19 @@ namespace nyaszip
             }
             return *this;
         }
+        /// @brief apply on `src` and put the result into `dst`, the copied chunk is still in cache when applying
+        CTR & apply(u8 * dst, u8 const* src, u64 length)
+        {
+            constexpr u64 CHUNK_LENGTH = 4 * 1024;
+            while (length != 0)
+            {
+                u64 chunk = ::std::min(length, CHUNK_LENGTH);
+                ::std::memcpy(dst, src, chunk);
+                apply(dst, chunk);
+                dst += chunk; src += chunk; length -= chunk;
+            }
+            return *this;
+        }
     };
 
     namespace Hash
@@ -1178,6 +1221,13 @@ namespace nyaszip
             _auth.update(data, length);
             return *this;
         }
+        /// @brief encrypt `src` into `dst` out of place
+        ZipAES & apply(u8 * dst, u8 const* src, u64 length)
+        {
+            _ctr.apply(dst, src, length);
+            _auth.update(dst, length);
+            return *this;
+        }
     };
 
 
@@ -1214,9 +1264,413 @@ namespace nyaszip
         /// @brief the version of zip need to extract
         virtual u16 version() const noexcept = 0;
 
+        /// @brief the highest level can be set during compression, the lowest level is 1
+        virtual u8 max_level() const noexcept = 0;
+        /// @brief the current compression level
+        virtual u8 level() const noexcept = 0;
+        /// @brief change the compression level of the following data
+        virtual AbstractCompression & level(u8 level_) = 0;
+
         /// @brief compress data into buffer
         /// @return a tuple of (the length of compressed data, compressed length in buffer)
         virtual ::std::tuple<u64, u64> compress(u8 const* data, u64 length) = 0;
+        /// @brief compress all remaining data into buffer, call it until it returns 0
+        /// @return compressed length in buffer
+        virtual u64 finish() = 0;
+
+        /// @brief trial compression on a sample, without changing the state
+        /// @return the estimated compressed length of `data`
+        virtual u64 estimate(u8 const* data, u64 length) const = 0;
+    };
+
+    /// @brief write bits into bytes from the most significant bit, as bzip2 does
+    class BitWriter
+    {
+    protected:
+        ::std::vector<u8> _bytes;
+        u64 _acc;
+        u8 _acc_bits;   // the number of bits in `_acc` that not yet in `_bytes`, always smaller than 8
+
+    public:
+        BitWriter()
+        : _bytes(), _acc(0), _acc_bits(0) {}
+
+        /// @brief drop all bits, the memory is kept
+        BitWriter & clear() noexcept
+        {
+            _bytes.clear();
+            _acc = 0;
+            _acc_bits = 0;
+            return *this;
+        }
+
+        ::std::vector<u8> & bytes() noexcept
+        {
+            return _bytes;
+        }
+        ::std::vector<u8> const& bytes() const noexcept
+        {
+            return _bytes;
+        }
+        u64 bit_length() const noexcept
+        {
+            return _bytes.size() * 8 + _acc_bits;
+        }
+
+        /// @param length the number of bits, must not greater than 32
+        BitWriter & put(u32 value, u8 length)
+        {
+            _acc = (_acc << length) | (value & ((static_cast<u64>(1) << length) - 1));
+            _acc_bits += length;
+            while (_acc_bits >= 8)
+            {
+                _acc_bits -= 8;
+                _bytes.push_back(static_cast<u8>(_acc >> _acc_bits));
+            }
+            return *this;
+        }
+        /// @brief append all bits from `other`
+        BitWriter & put(BitWriter const& other)
+        {
+            if (_acc_bits == 0)
+            {
+                _bytes.insert(_bytes.end(), other._bytes.begin(), other._bytes.end());
+            }
+            else
+            {
+                for (u8 byte : other._bytes) { put(byte, 8); }
+            }
+            return put(static_cast<u32>(other._acc), other._acc_bits);
+        }
+        /// @brief fill zeros until the end of byte
+        BitWriter & align()
+        {
+            if (_acc_bits != 0) { put(0, 8 - _acc_bits); }
+            return *this;
+        }
+    };
+
+    /// @brief the crc-32 used in bzip2, same divisor as `crc32` but in msb-first order
+    static constexpr ::std::array<u32, 256> bzip2_crc_table = [] {
+        auto table = decltype(bzip2_crc_table){};
+        u32 b = 0;
+        ::std::for_each(table.begin(), table.end(), [&b](u32 & crc) {
+            crc = (b++) << 24;
+            for (u8 bit = 0; bit < 8; bit ++)
+            {
+                crc = (crc & 0x80000000) ? ((crc << 1) ^ 0x04C11DB7) : (crc << 1);
+            }
+        });
+        return table;
+    }();
+    static inline u32 bzip2_crc(u32 crc /* set to 0 first */, u8 byte, u64 repeat)
+    {
+        u32 tmp = ~crc; // pre-conditioning
+        for (; repeat != 0; repeat--)
+        {
+            tmp = (tmp << 8) ^ bzip2_crc_table[(tmp >> 24) ^ byte];
+        }
+        return ~tmp;    // post-conditioning
+    }
+
+    class BZip2_basic   // store algorithms used in bzip2 block
+    {
+    public:
+        static constexpr u16 MAX_ALPHA_SIZE = 258;
+        static constexpr u8 MAX_CODE_LENGTH = 17;
+        static constexpr u8 GROUP_LENGTH = 50;
+        static constexpr u8 MAX_TABLES = 6;
+        static constexpr u16 RUNA = 0;
+        static constexpr u16 RUNB = 1;
+
+        /// @brief the initial run-length encoding, `length` must in [1, 255]
+        static void push_run(::std::vector<u8> & block, u8 byte, u8 length)
+        {
+            block.insert(block.end(), ::std::min(length, static_cast<u8>(4)), byte);
+            if (length >= 4) { block.push_back(length - 4); }
+        }
+
+        /// @brief sort all rotations of `block` by prefix doubling,
+        /// identical rotations (periodic block) are sorted in any order, which is fine for BWT.
+        /// @return the start of rotations in sorted order
+        static ::std::vector<u32> sort_rotations(u8 const* block, u32 length)
+        {
+            ::std::vector<u32> p(length), pn(length), c(length), cn(length);
+            ::std::vector<u32> count(::std::max(length, static_cast<u32>(256)), 0);
+
+            // sort by the first byte
+            for (u32 i = 0; i < length; i++) { count[block[i]]++; }
+            for (u32 i = 1; i < 256; i++) { count[i] += count[i - 1]; }
+            for (u32 i = length; i-- > 0;) { p[--count[block[i]]] = i; }
+            u32 classes = 1;
+            c[p[0]] = 0;
+            for (u32 i = 1; i < length; i++)
+            {
+                if (block[p[i]] != block[p[i - 1]]) { classes++; }
+                c[p[i]] = classes - 1;
+            }
+
+            // sort by the first 2h bytes using the order of the first h bytes
+            for (u32 h = 1; h < length && classes < length; h <<= 1)
+            {
+                for (u32 i = 0; i < length; i++)
+                {
+                    pn[i] = p[i] >= h ? p[i] - h : p[i] + length - h;
+                }
+                ::std::fill(count.begin(), count.begin() + classes, 0);
+                for (u32 i = 0; i < length; i++) { count[c[pn[i]]]++; }
+                for (u32 i = 1; i < classes; i++) { count[i] += count[i - 1]; }
+                for (u32 i = length; i-- > 0;) { p[--count[c[pn[i]]]] = pn[i]; }
+
+                classes = 1;
+                cn[p[0]] = 0;
+                for (u32 i = 1; i < length; i++)
+                {
+                    u32 curr = p[i] + h, prev = p[i - 1] + h;
+                    if (curr >= length) { curr -= length; }
+                    if (prev >= length) { prev -= length; }
+                    if (c[p[i]] != c[p[i - 1]] || c[curr] != c[prev]) { classes++; }
+                    cn[p[i]] = classes - 1;
+                }
+                c.swap(cn);
+            }
+            return p;
+        }
+
+        /// @brief limited-length huffman code lengths, scale down the frequencies until it fits
+        static void code_lengths(u8 * lengths, u32 const* freq, u16 alpha_size, u8 max_length)
+        {
+            using Node = ::std::tuple<u64, u16>;   // (weight << 8 | depth, node index)
+            u64 weight[MAX_ALPHA_SIZE];
+            u16 parent[MAX_ALPHA_SIZE * 2];
+            for (u16 i = 0; i < alpha_size; i++) { weight[i] = ::std::max(freq[i], static_cast<u32>(1)); }
+
+            while (true)
+            {
+                ::std::priority_queue<Node, ::std::vector<Node>, ::std::greater<Node>> heap;
+                for (u16 i = 0; i < alpha_size; i++) { heap.push({weight[i] << 8, i}); }
+
+                u16 next = alpha_size;
+                while (heap.size() > 1)
+                {
+                    auto [w0, n0] = heap.top(); heap.pop();
+                    auto [w1, n1] = heap.top(); heap.pop();
+                    parent[n0] = parent[n1] = next;
+                    u64 depth = ::std::min(static_cast<u64>(0xFF), 1 + ::std::max(w0 & 0xFF, w1 & 0xFF));
+                    heap.push({(((w0 >> 8) + (w1 >> 8)) << 8) | depth, next++});
+                }
+
+                bool too_long = false;
+                u16 const root = next - 1;
+                for (u16 i = 0; i < alpha_size; i++)
+                {
+                    u8 depth = 0;
+                    for (u16 n = i; n != root; n = parent[n]) { depth++; }
+                    lengths[i] = depth;
+                    too_long |= depth > max_length;
+                }
+                if (!too_long) { return; }
+
+                for (u16 i = 0; i < alpha_size; i++) { weight[i] = 1 + weight[i] / 2; }
+            }
+        }
+
+        /// @brief compress a block (after the initial run-length encoding) into bits, without stream header
+        static BitWriter encode_block(u8 const* block, u32 length, u32 crc)
+        {
+            BitWriter out;
+
+            /* Burrows–Wheeler transform */
+
+            ::std::vector<u32> rotations = sort_rotations(block, length);
+            u32 orig_ptr = 0;
+
+            bool in_use[256] = {false};
+            for (u32 i = 0; i < length; i++) { in_use[block[i]] = true; }
+            u8 unseq_to_seq[256];
+            u16 n_in_use = 0;
+            for (u16 i = 0; i < 256; i++)
+            {
+                if (in_use[i]) { unseq_to_seq[i] = static_cast<u8>(n_in_use++); }
+            }
+
+            /* move-to-front & run-length encoding of zeros */
+
+            u16 const alpha_size = n_in_use + 2;
+            u16 const eob = n_in_use + 1;
+            ::std::vector<u16> mtfv;
+            mtfv.reserve(length + 1);
+            u32 mtf_freq[MAX_ALPHA_SIZE] = {0};
+            u8 order[256];
+            for (u16 i = 0; i < n_in_use; i++) { order[i] = static_cast<u8>(i); }
+
+            u32 zeros = 0;
+            auto push_zeros = [&] {
+                if (zeros == 0) { return; }
+                zeros--;
+                while (true)
+                {
+                    u16 run = (zeros & 1) ? RUNB : RUNA;
+                    mtfv.push_back(run);
+                    mtf_freq[run]++;
+                    if (zeros < 2) { break; }
+                    zeros = (zeros - 2) / 2;
+                }
+                zeros = 0;
+            };
+            for (u32 i = 0; i < length; i++)
+            {
+                u32 start = rotations[i];
+                if (start == 0) { orig_ptr = i; }
+                u8 symbol = unseq_to_seq[block[start == 0 ? length - 1 : start - 1]];
+
+                if (order[0] == symbol)
+                {
+                    zeros++;
+                    continue;
+                }
+                push_zeros();
+                u16 j = 1;
+                u8 tmp = ::std::exchange(order[0], symbol);
+                while (tmp != symbol) { ::std::swap(tmp, order[j++]); }
+                mtfv.push_back(j);
+                mtf_freq[j]++;
+            }
+            push_zeros();
+            mtfv.push_back(eob);
+            mtf_freq[eob]++;
+            ::std::vector<u32>().swap(rotations);
+
+            /* huffman tables */
+
+            u32 const n_mtf = static_cast<u32>(mtfv.size());
+            u8 const n_groups = n_mtf < 200 ? 2 : n_mtf < 600 ? 3 : n_mtf < 1200 ? 4 : n_mtf < 2400 ? 5 : 6;
+            u8 lengths[MAX_TABLES][MAX_ALPHA_SIZE];
+
+            // initial tables, each one cheaply codes a slice of symbols with similar total frequency
+            {
+                u32 remaining = n_mtf;
+                u16 gs = 0;
+                for (u8 part = n_groups; part > 0; part--)
+                {
+                    u32 target = remaining / part, acc = 0;
+                    i32 ge = static_cast<i32>(gs) - 1;
+                    while (acc < target && ge < alpha_size - 1) { acc += mtf_freq[++ge]; }
+                    if (ge > gs && part != n_groups && part != 1 && ((n_groups - part) & 1))
+                    {
+                        acc -= mtf_freq[ge--];
+                    }
+                    for (u16 v = 0; v < alpha_size; v++)
+                    {
+                        lengths[part - 1][v] = (v >= gs && static_cast<i32>(v) <= ge) ? 0 : 15;
+                    }
+                    gs = static_cast<u16>(ge + 1);
+                    remaining -= acc;
+                }
+            }
+
+            // refine tables by assigning each group to its cheapest table
+            ::std::vector<u8> selectors;
+            selectors.reserve(n_mtf / GROUP_LENGTH + 1);
+            for (u8 iter = 0; iter < 4; iter++)
+            {
+                u32 freq[MAX_TABLES][MAX_ALPHA_SIZE] = {{0}};
+                selectors.clear();
+                for (u32 gs = 0; gs < n_mtf; gs += GROUP_LENGTH)
+                {
+                    u32 ge = ::std::min(gs + GROUP_LENGTH, n_mtf);
+                    u32 cost[MAX_TABLES] = {0};
+                    for (u32 i = gs; i < ge; i++)
+                    {
+                        for (u8 t = 0; t < n_groups; t++) { cost[t] += lengths[t][mtfv[i]]; }
+                    }
+                    u8 best = static_cast<u8>(::std::min_element(cost, cost + n_groups) - cost);
+                    selectors.push_back(best);
+                    for (u32 i = gs; i < ge; i++) { freq[best][mtfv[i]]++; }
+                }
+                for (u8 t = 0; t < n_groups; t++)
+                {
+                    code_lengths(lengths[t], freq[t], alpha_size, MAX_CODE_LENGTH);
+                }
+            }
+
+            u32 codes[MAX_TABLES][MAX_ALPHA_SIZE];
+            for (u8 t = 0; t < n_groups; t++)
+            {
+                u8 const* len = lengths[t];
+                u8 min_len = *::std::min_element(len, len + alpha_size);
+                u8 max_len = *::std::max_element(len, len + alpha_size);
+                u32 code = 0;
+                for (u8 n = min_len; n <= max_len; n++)
+                {
+                    for (u16 i = 0; i < alpha_size; i++)
+                    {
+                        if (len[i] == n) { codes[t][i] = code++; }
+                    }
+                    code <<= 1;
+                }
+            }
+
+            /* output */
+
+            out.put(0x314159, 24).put(0x265359, 24);
+            out.put(crc, 32);
+            out.put(0 /* not randomised */, 1);
+            out.put(orig_ptr, 24);
+
+            u16 used16 = 0;
+            for (u8 i = 0; i < 16; i++)
+            {
+                if (::std::any_of(in_use + i * 16, in_use + i * 16 + 16, [](bool b) { return b; }))
+                {
+                    used16 |= static_cast<u16>(1) << (15 - i);
+                }
+            }
+            out.put(used16, 16);
+            for (u8 i = 0; i < 16; i++)
+            {
+                if (used16 & (static_cast<u16>(1) << (15 - i)))
+                {
+                    for (u8 j = 0; j < 16; j++) { out.put(in_use[i * 16 + j], 1); }
+                }
+            }
+
+            out.put(n_groups, 3);
+            out.put(static_cast<u32>(selectors.size()), 15);
+            u8 table_order[MAX_TABLES] = {0, 1, 2, 3, 4, 5};
+            for (u8 sel : selectors)
+            {
+                u8 j = 0;
+                u8 tmp = ::std::exchange(table_order[0], sel);
+                while (tmp != sel) { ::std::swap(tmp, table_order[++j]); }
+                for (u8 k = 0; k < j; k++) { out.put(1, 1); }
+                out.put(0, 1);
+            }
+
+            for (u8 t = 0; t < n_groups; t++)
+            {
+                u8 curr = lengths[t][0];
+                out.put(curr, 5);
+                for (u16 i = 0; i < alpha_size; i++)
+                {
+                    for (; curr < lengths[t][i]; curr++) { out.put(2, 2); }
+                    for (; curr > lengths[t][i]; curr--) { out.put(3, 2); }
+                    out.put(0, 1);
+                }
+            }
+
+            for (u32 g = 0; g < selectors.size(); g++)
+            {
+                u8 const t = selectors[g];
+                u32 const gs = g * GROUP_LENGTH, ge = ::std::min(gs + GROUP_LENGTH, n_mtf);
+                for (u32 i = gs; i < ge; i++)
+                {
+                    out.put(codes[t][mtfv[i]], lengths[t][mtfv[i]]);
+                }
+            }
+
+            return out;
+        }
     };
 
     class FileAttributes
@@ -1305,157 +1759,1930 @@ namespace nyaszip
         static constexpr u16 Twofish      = 63;
     };
 
-    class Zip
+    /// @brief bzip2 (method 12), blocks are compressed concurrently and stitched into one stream
+    class BZip2Compression : public AbstractCompression
     {
     public:
-        static constexpr u64 BUFFER_LENGTH = 4 * 1024;  // 4KiB
-
-        static Zip create(::std::string const& path)
-        {
-            auto output_ = new ::std::ofstream(path, ::std::ios::trunc | ::std::ios::binary);
-            return Zip(*output_, true);
-        }
+        static constexpr u8 METHOD = 12;
 
     protected:
-        friend class LocalFile;
-
-        ::std::ostream * _output;
-        bool _owned_output;
-        WritingState _state;
-        i64 _offset;        // zip start
-
-        bool _zip64;
-        ::std::list<LocalFile> _files;
-        ::std::string _comment;
-        PCG_XSH_RR _random;
-        u8 * _buffer;       // all writing must pass through this buffer
-
-        Zip(Zip const&) = delete;
-        Zip & operator =(Zip const&) = delete;
-
-        void _init()
-        {
-            _state = WritingState::Writing;
-            _offset = _output->tellp();
-
-            _zip64 = false;
-            _comment = "";
-            _buffer = new u8[BUFFER_LENGTH];
-            if (_buffer == nullptr)
+        u8 _level;      // block size in 100k, [1, 9], declared in stream header
+        u8 _block_level;    // block size of the following blocks, not greater than `_level`
+        u32 _threads;   // the max number of blocks compressing at the same time
+        u32 _block_limit;
+
+        ::std::vector<u8> _block;   // data after the initial run-length encoding
+        u32 _block_crc;
+        u32 _combined_crc;
+        u8 _run_byte;
+        u8 _run_length;
+        u64 _blocks;    // the number of dispatched blocks
+
+        ::std::list<::std::tuple<::std::future<BitWriter>, u32>> _jobs;   // (compressed block, block crc)
+        BitWriter _stream;
+        u64 _drained;   // the length of `_stream.bytes()` that already moved into buffer
+        bool _finished;
+
+        /// @brief move compressed stream into buffer
+        u64 _drain()
+        {
+            auto & bytes = _stream.bytes();
+            u64 length = ::std::min(BUFFER_LENGTH, bytes.size() - _drained);
+            ::std::memcpy(_buffer, bytes.data() + _drained, length);
+            _drained += length;
+            if (_drained == bytes.size())
             {
-                throw ::std::bad_alloc();
+                bytes.clear();
+                _drained = 0;
             }
+            return length;
         }
 
-        void _gen_salt(u8 * salt, u64 length)
+        void _push_run()
         {
-            _random.gen(salt, length);
-        }
-        void _write(void const* data, u64 length)
-        {
-            _output->write((char const*)data, length);
+            if (_run_length == 0) { return; }
+            if (_block.size() + 5 > _block_limit) { _dispatch(); }
+
+            _block_crc = bzip2_crc(_block_crc, _run_byte, _run_length);
+            BZip2_basic::push_run(_block, _run_byte, _run_length);
+            _run_length = 0;
         }
-        void _write_buffer(u8 * const end)
+        /// @brief send the current block to a worker thread
+        void _dispatch()
         {
-            _write_buffer(end - _buffer);
+            if (_block.empty()) { return; }
+            while (_jobs.size() >= _threads) { _collect(); }
+
+            u32 crc = ::std::exchange(_block_crc, 0);
+            _blocks++;
+            if (_threads <= 1)
+            {
+                ::std::promise<BitWriter> done;
+                done.set_value(BZip2_basic::encode_block(_block.data(), static_cast<u32>(_block.size()), crc));
+                _jobs.emplace_back(done.get_future(), crc);
+                _block.clear();
+            }
+            else
+            {
+                _jobs.emplace_back(::std::async(::std::launch::async, [block = ::std::move(_block), crc] {
+                    return BZip2_basic::encode_block(block.data(), static_cast<u32>(block.size()), crc);
+                }), crc);
+                _block = ::std::vector<u8>();
+                _block.reserve(100000 * _level);
+            }
         }
-        void _write_buffer(u64 length)
+        /// @brief stitch the oldest block into stream
+        void _collect()
         {
-            _output->write((char const*)_buffer, length);
+            auto & [job, crc] = _jobs.front();
+            _stream.put(job.get());
+            _combined_crc = ::std::rotl(_combined_crc, 1) ^ crc;
+            _jobs.pop_front();
         }
-        i64 _tellp()
-        {
-            return _output->tellp() - _offset;
+
+    public:
+        /// @param level block size in 100k, [1, 9]
+        /// @param threads the number of blocks compressed concurrently, 0 for the number of cpu cores
+        BZip2Compression(u8 level = 9, u32 threads = 0)
+        : AbstractCompression(), _block(), _jobs(), _stream() {
+            reset(level, threads);
         }
-        void _seekp(i64 offset_)
+
+        virtual ~BZip2Compression()
         {
-            _output->seekp(_offset + offset_);
+            // wait for all workers before the blocks are destroyed
+            for (auto & [job, crc] : _jobs) { if (job.valid()) { job.wait(); } }
         }
 
-        ::std::tuple<u64, u64> _write_central_direction();  // -> (cd_size, cd_offset)
-        u64 _write_zip64_record(u64 cd_size, u64 cd_offset) // -> record offset
+        /// @brief start a new stream, the memory of blocks and stream is reused
+        BZip2Compression & reset(u8 level = 9, u32 threads = 0)
         {
-            u64 record_offset = ::std::bit_cast<u64>(_tellp());
+            for (auto & [job, crc] : _jobs) { if (job.valid()) { job.wait(); } }
+            _jobs.clear();
 
-            u8 * record = _buffer;
-            _write_into<u32>(record, 0x06064B50);
-            _write_into<u64>(record, 44);
-            _write_into<u16>(record, VersionMadeOf);
-            _write_into<u16>(record, VersionNeedToExtra::Zip64);
-            _write_into<u32>(record, 0 /* number of this disk */);
-            _write_into<u32>(record, 0 /* number of the disk with the start of the central directory */);
-            _write_into<u64>(record, _files.size() /* total number of entries in the central directory on this disk */);
-            _write_into<u64>(record, _files.size() /* total number of entries in the central directory */);
-            _write_into<u64>(record, cd_size);
-            _write_into<u64>(record, cd_offset);
-            _write_buffer(record);
+            _level = ::std::clamp(level, static_cast<u8>(1), static_cast<u8>(9));
+            _threads = threads != 0 ? threads : ::std::max(::std::thread::hardware_concurrency(), 1u);
+            _block_level = _level;
+            _block_limit = 100000 * _block_level - 19;
 
-            return record_offset;
+            _block.clear();
+            _block.reserve(100000 * _level);
+            _block_crc = 0;
+            _combined_crc = 0;
+            _run_byte = 0;
+            _run_length = 0;
+            _blocks = 0;
+            _drained = 0;
+            _finished = false;
+
+            _stream.clear().put('B', 8).put('Z', 8).put('h', 8).put('0' + _level, 8);
+            return *this;
         }
-        void _write_zip64_locator(u64 record_offset)
+
+        virtual u8 method() const noexcept override
         {
-            u8 * locator = _buffer;
-            _write_into<u32>(locator, 0x07064B50);
-            _write_into<u32>(locator, 0 /* number of the disk with the start of the zip64 end of central directory */);
-            _write_into<u64>(locator, record_offset);
-            _write_into<u32>(locator, 1 /* total number of disks */);
-            _write_buffer(locator);
+            return METHOD;
         }
-        void _write_end_of_central_direction(u64 cd_size, u64 cd_offset)
+        virtual u16 version() const noexcept override
         {
-            u16 total_files = ::std::min(static_cast<u64>(0xFFFF), _files.size());
-            cd_size =     ::std::min(static_cast<u64>(0xFFFFFFFF), cd_size);
-            cd_offset =   ::std::min(static_cast<u64>(0xFFFFFFFF), cd_offset);
-            u16 comment_length = _comment.size() & 0xFFFF;
-
-            u8 * end = _buffer;
-            _write_into<u32>(end, 0x06054B50);
-            _write_into<u16>(end, 0 /* number of this disk */);
-            _write_into<u16>(end, 0 /* number of the disk with the start of the central directory */);
-            _write_into<u16>(end, total_files /* total number of entries in the central directory on this disk */);
-            _write_into<u16>(end, total_files /* total number of entries in the central directory */);
-            _write_into<u32>(end, static_cast<u32>(cd_size));
-            _write_into<u32>(end, static_cast<u32>(cd_offset));
-            _write_into<u16>(end, comment_length);
-            _write_buffer(end);
-
-            _write(_comment.c_str(), comment_length);
+            return VersionNeedToExtra::BZip2;
         }
-
-    public:
-        Zip(::std::ostream & output_, bool owned_output_ = false) noexcept
-        : _output(::std::addressof(output_)), _owned_output(owned_output_), _files(), _random() {
-            _init();
+        virtual u8 max_level() const noexcept override
+        {
+            return _level;
         }
-
-        ~Zip();
-
-        ::std::ostream & output() noexcept
+        virtual u8 level() const noexcept override
         {
-            return *_output;
+            return _block_level;
         }
-        ::std::ostream const& output() const noexcept
+        /// @brief change the block size of the following blocks, the current block may be ended early
+        virtual BZip2Compression & level(u8 level_) override
         {
-            return *_output;
+            _block_level = ::std::clamp(level_, static_cast<u8>(1), _level);
+            _block_limit = 100000 * _block_level - 19;
+            return *this;
         }
-
-        /* from _output */
-
-        bool good() const
+        u32 threads() const noexcept
         {
-            return _output->good();
+            return _threads;
+        }
+
+        virtual ::std::tuple<u64, u64> compress(u8 const* data, u64 length) override
+        {
+            if (u64 drained = _drain(); drained != 0) { return {0, drained}; }
+
+            u64 consumed = 0;
+            u64 const blocks = _blocks;
+            while (consumed < length && _blocks == blocks)
+            {
+                u8 byte = data[consumed++];
+                if (byte == _run_byte && _run_length != 0 && _run_length < 255)
+                {
+                    _run_length++;
+                }
+                else
+                {
+                    _push_run();
+                    _run_byte = byte;
+                    _run_length = 1;
+                }
+            }
+            // stitch finished blocks as soon as possible to keep the memory bounded
+            while (!_jobs.empty() && ::std::get<0>(_jobs.front()).wait_for(::std::chrono::seconds(0)) == ::std::future_status::ready)
+            {
+                _collect();
+            }
+            return {consumed, _drain()};
+        }
+        virtual u64 finish() override
+        {
+            if (!_finished)
+            {
+                _push_run();
+                _dispatch();
+                while (!_jobs.empty()) { _collect(); }
+
+                _stream.put(0x177245, 24).put(0x385090, 24);
+                _stream.put(_combined_crc, 32);
+                _stream.align();
+                _finished = true;
+            }
+            return _drain();
+        }
+
+        virtual u64 estimate(u8 const* data, u64 length) const override
+        {
+            // compress the sample as a single block, only the part fits in one block is used
+            ::std::vector<u8> block;
+            block.reserve(::std::min(static_cast<u64>(_block_limit), length + length / 4 + 5));
+            u64 consumed = 0;
+            while (consumed < length && block.size() + 5 <= _block_limit)
+            {
+                u8 byte = data[consumed];
+                u8 run = 1;
+                while (consumed + run < length && run < 255 && data[consumed + run] == byte) { run++; }
+                BZip2_basic::push_run(block, byte, run);
+                consumed += run;
+            }
+            if (consumed == 0) { return 0; }
+
+            u64 bits = BZip2_basic::encode_block(block.data(), static_cast<u32>(block.size()), 0).bit_length();
+            bits += 32 /* stream header */ + 80 /* end of stream */;
+            return (bits + 7) / 8 * length / consumed;
+        }
+    };
+
+    /// @brief adjust the compression level at runtime by comparing the time spent in compression and output,
+    /// to keep the writing bound by the output instead of the compression.
+    class AdaptiveLevel
+    {
+    public:
+        static constexpr u8 MAX_LEVEL = 9;
+        /// @brief make a decision after every window of data
+        static constexpr u64 WINDOW_LENGTH = 4 * 1024 * 1024;   // 4MiB
+        /// @brief only change the level if one side is slower than the other by this factor
+        static constexpr double HYSTERESIS = 0.25;
+
+        struct Stats
+        {
+            u8 level;       // the current level, 0 for storing the file
+            u64 raised;     // the number of times the level was raised
+            u64 lowered;    // the number of times the level was lowered
+            u64 stored;     // the number of files stored because of level 0
+            double compress_rate[MAX_LEVEL + 1];    // input bytes per second of compression, 0 if unknown
+            double ratio[MAX_LEVEL + 1];            // compressed length / input length, 0 if unknown
+            double output_rate;                     // output bytes per second, 0 if unknown
+        };
+
+    protected:
+        u8 _min_level, _max_level;
+        Stats _stats;
+        u64 _input, _compressed, _output;  // in the current window
+        double _cmpr_seconds, _out_seconds;
+
+        static double _average(double old, double value) noexcept
+        {
+            return old == 0 ? value : (old + value) / 2;
+        }
+        /// @return the time spent in (compression, output) per input byte at `level`
+        ::std::tuple<double, double> _time_per_byte(u8 level) const noexcept
+        {
+            double rate = _stats.compress_rate[level];
+            double cmpr = rate == 0 ? 0 /* unknown */ : 1 / rate;
+            return {cmpr, _stats.ratio[level] / _stats.output_rate};
+        }
+
+    public:
+        AdaptiveLevel(u8 min_level = 0, u8 max_level = MAX_LEVEL) noexcept
+        {
+            _max_level = ::std::min(max_level, MAX_LEVEL);
+            _min_level = ::std::min(min_level, _max_level);
+            _stats.level = _max_level;
+            _stats.raised = _stats.lowered = _stats.stored = 0;
+            ::std::fill(_stats.compress_rate, _stats.compress_rate + MAX_LEVEL + 1, 0);
+            ::std::fill(_stats.ratio, _stats.ratio + MAX_LEVEL + 1, 0);
+            _stats.ratio[0] = 1;    // storing
+            _stats.output_rate = 0;
+            _input = _compressed = _output = 0;
+            _cmpr_seconds = _out_seconds = 0;
+        }
+
+        u8 level() const noexcept
+        {
+            return _stats.level;
+        }
+        Stats const& stats() const noexcept
+        {
+            return _stats;
+        }
+
+        /// @brief record a compression of `input` bytes into `compressed` bytes
+        AdaptiveLevel & compressed(u64 input, u64 compressed_, double seconds) noexcept
+        {
+            _input += input;
+            _compressed += compressed_;
+            _cmpr_seconds += seconds;
+            return *this;
+        }
+        /// @brief record an output of `length` bytes
+        AdaptiveLevel & wrote(u64 length, double seconds) noexcept
+        {
+            _output += length;
+            _out_seconds += seconds;
+            return *this;
+        }
+        /// @brief record that a file is stored because of level 0
+        AdaptiveLevel & stored() noexcept
+        {
+            _stats.stored++;
+            return *this;
+        }
+
+        /// @brief decide the level if a window of data is recorded
+        /// @return whether the level is changed
+        bool update() noexcept
+        {
+            u8 const level = _stats.level;
+            if (::std::max(_input, _output) < WINDOW_LENGTH) { return false; }
+
+            if (level != 0 && _input != 0 && _cmpr_seconds > 0)
+            {
+                _stats.compress_rate[level] = _average(_stats.compress_rate[level], _input / _cmpr_seconds);
+                _stats.ratio[level] = _average(_stats.ratio[level], static_cast<double>(_compressed) / _input);
+            }
+            if (_out_seconds > 0)
+            {
+                _stats.output_rate = _average(_stats.output_rate, _output / _out_seconds);
+            }
+            _input = _compressed = _output = 0;
+            _cmpr_seconds = _out_seconds = 0;
+            if (_stats.output_rate == 0) { return false; }
+
+            auto [cmpr, out] = _time_per_byte(level);
+            if (level > _min_level && level != 0 && cmpr > out * (1 + HYSTERESIS))
+            {
+                // compression is the bottleneck
+                _stats.level--;
+                _stats.lowered++;
+                return true;
+            }
+            if (level < _max_level)
+            {
+                // raise if the next level is expected to be bound by output, or try it if unknown
+                u8 next = level + 1;
+                bool raise = _stats.compress_rate[next] == 0 ? out > cmpr * (1 + HYSTERESIS) : [&] {
+                    auto [next_cmpr, next_out] = _time_per_byte(next);
+                    return next_cmpr * (1 + HYSTERESIS) < next_out;
+                }();
+                if (raise)
+                {
+                    _stats.level = next;
+                    _stats.raised++;
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+#ifdef NYASZIP_POSIX
+    using ::iovec;
+#else
+    /// @brief a segment of memory for `writev`, the same as the POSIX one
+    struct iovec
+    {
+        void * iov_base;
+        size_t iov_len;
+    };
+#endif
+
+    /// @brief the output of zip writer, data is appended sequentially, and the headers written before are patched in place
+    class Sink
+    {
+    public:
+        virtual ~Sink() = default;
+
+        /// @brief append data at the end
+        virtual void write(void const* data, u64 length) = 0;
+        /// @brief append the segments at the end in order
+        virtual void writev(iovec const* segments, u64 count)
+        {
+            for (u64 idx = 0; idx < count; idx++) { write(segments[idx].iov_base, segments[idx].iov_len); }
+        }
+        /// @brief overwrite the data written before at `offset` (from the start of sink), the end is not changed
+        virtual void pwrite(void const* data, u64 length, u64 offset) = 0;
+        /// @brief the offset of the end
+        virtual u64 tell() = 0;
+        virtual void flush() = 0;
+        virtual ::std::ios::iostate rdstate() const = 0;
+        /// @brief `pwrite` is supported, false for pipes, sockets, terminals, ...
+        virtual bool seekable() const
+        {
+            return true;
+        }
+
+        /// @brief get the memory where the next `length` bytes are appended directly, valid until the next call
+        /// to the sink, then call `commit` after filling it. return nullptr if not supported, use `write` instead.
+        virtual u8 * reserve([[maybe_unused]] u64 length)
+        {
+            return nullptr;
+        }
+        virtual void commit([[maybe_unused]] u64 length)
+        {}
+
+        /// @brief the length can be appended without waiting for the writes in flight, -1 if never waiting
+        virtual u64 writable()
+        {
+            return ~static_cast<u64>(0);
+        }
+        /// @brief handle the writes completed, without waiting. return false if nothing is completed
+        virtual bool poll()
+        {
+            return false;
+        }
+        /// @brief the file descriptor readable when there are writes completed (see `poll`), -1 if none
+        virtual int event_fd() const
+        {
+            return -1;
+        }
+
+        bool good() const
+        {
+            return rdstate() == ::std::ios::goodbit;
+        }
+        bool fail() const
+        {
+            return (rdstate() & (::std::ios::failbit | ::std::ios::badbit)) != 0;
+        }
+        bool bad() const
+        {
+            return (rdstate() & ::std::ios::badbit) != 0;
+        }
+    };
+
+    /// @brief write into an `ostream`, the headers are patched by seeking
+    class OStreamSink : public Sink
+    {
+    protected:
+        ::std::ostream * _output;
+        bool _owned_output;
+        bool _seekable;
+        u64 _end;
+
+        OStreamSink(OStreamSink const&) = delete;
+        OStreamSink & operator =(OStreamSink const&) = delete;
+
+    public:
+        OStreamSink(::std::ostream & output_, bool owned_output_ = false)
+        : _output(::std::addressof(output_)), _owned_output(owned_output_)
+        {
+            auto pos = _output->tellp();
+            _seekable = pos != ::std::ostream::pos_type(-1);
+            _end = _seekable ? static_cast<u64>(pos) : 0;
+        }
+
+        virtual ~OStreamSink() override
+        {
+            if (_owned_output)
+            {
+                _output->flush();
+                delete _output;
+            }
+        }
+
+        ::std::ostream & stream() noexcept
+        {
+            return *_output;
+        }
+
+        virtual void write(void const* data, u64 length) override
+        {
+            _output->write(static_cast<char const*>(data), length);
+            _end += length;
+        }
+        virtual void pwrite(void const* data, u64 length, u64 offset) override
+        {
+            _output->seekp(offset);
+            _output->write(static_cast<char const*>(data), length);
+            _output->seekp(_end);
+        }
+        virtual u64 tell() override
+        {
+            return _end;
+        }
+        virtual void flush() override
+        {
+            _output->flush();
+        }
+        virtual ::std::ios::iostate rdstate() const override
+        {
+            return _output->rdstate();
+        }
+        virtual bool seekable() const override
+        {
+            return _seekable;
+        }
+    };
+
+#ifdef NYASZIP_POSIX
+    /// @brief write into a POSIX file descriptor by `write` and `pwrite` without user space buffering,
+    /// the headers are patched by `pwrite` without moving the file offset
+    class FdSink : public Sink
+    {
+    protected:
+        int _fd;
+        bool _owned_fd;
+        bool _seekable;
+        u64 _end;
+        ::std::ios::iostate _state;
+
+        FdSink(FdSink const&) = delete;
+        FdSink & operator =(FdSink const&) = delete;
+
+    public:
+        /// @brief write into `fd` from its current offset
+        FdSink(int fd, bool owned_fd = false) noexcept
+        : _fd(fd), _owned_fd(owned_fd), _seekable(false), _end(0), _state(::std::ios::goodbit)
+        {
+            if (_fd < 0)
+            {
+                _state = ::std::ios::failbit;
+                return;
+            }
+            if (off_t pos = ::lseek(_fd, 0, SEEK_CUR); pos >= 0)
+            {
+                _seekable = true;
+                _end = static_cast<u64>(pos);
+            }
+        }
+        /// @brief create (or truncate) the file at `path`
+        FdSink(::std::string const& path) noexcept
+        : FdSink(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666), true) {}
+
+        virtual ~FdSink() override
+        {
+            if (_owned_fd && _fd >= 0)
+            {
+                ::close(_fd);
+            }
+        }
+
+        int fd() const noexcept
+        {
+            return _fd;
+        }
+
+        virtual void write(void const* data, u64 length) override
+        {
+            if (_state != ::std::ios::goodbit) { return; }
+            auto ptr = static_cast<u8 const*>(data);
+            while (length != 0)
+            {
+                ssize_t written = ::write(_fd, ptr, length);
+                if (written < 0)
+                {
+                    if (errno == EINTR) { continue; }
+                    _state |= ::std::ios::badbit;
+                    return;
+                }
+                ptr += written; length -= written;
+                _end += written;
+            }
+        }
+        virtual void writev(iovec const* segments, u64 count) override
+        {
+            constexpr u64 MAX_SEGMENTS = 1024;  // IOV_MAX
+            while (count != 0 && _state == ::std::ios::goodbit)
+            {
+                ssize_t written = ::writev(_fd, segments, static_cast<int>(::std::min(count, MAX_SEGMENTS)));
+                if (written < 0)
+                {
+                    if (errno == EINTR) { continue; }
+                    _state |= ::std::ios::badbit;
+                    return;
+                }
+                _end += written;
+                u64 remain = static_cast<u64>(written);
+                while (count != 0 && remain >= segments->iov_len)
+                {
+                    remain -= segments->iov_len;
+                    segments++; count--;
+                }
+                if (remain != 0)
+                {
+                    // finish the partially written segment
+                    FdSink::write(static_cast<u8 const*>(segments->iov_base) + remain, segments->iov_len - remain);
+                    segments++; count--;
+                }
+            }
+        }
+        virtual void pwrite(void const* data, u64 length, u64 offset) override
+        {
+            if (_state != ::std::ios::goodbit) { return; }
+            auto ptr = static_cast<u8 const*>(data);
+            while (length != 0)
+            {
+                ssize_t written = ::pwrite(_fd, ptr, length, static_cast<off_t>(offset));
+                if (written < 0)
+                {
+                    if (errno == EINTR) { continue; }
+                    _state |= ::std::ios::badbit;
+                    return;
+                }
+                ptr += written; length -= written;
+                offset += written;
+            }
+        }
+        virtual u64 tell() override
+        {
+            return _end;
+        }
+        virtual void flush() override
+        {}
+        virtual ::std::ios::iostate rdstate() const override
+        {
+            return _state;
+        }
+        virtual bool seekable() const override
+        {
+            return _seekable;
+        }
+    };
+#endif
+
+#ifdef NYASZIP_POSIX
+    /// @brief write into a memory-mapped file, preallocated to the estimated size and grown if needed, the data is
+    /// copied (or encrypted) into the mapping directly, and the headers are patched by memory stores. The file is
+    /// truncated to the real length when flushing.
+    class MmapSink : public FdSink
+    {
+    public:
+        static constexpr u64 MIN_CAPACITY = 64 * 1024 * 1024;     // 64MiB
+
+    protected:
+        u8 * _map;
+        u64 _capacity;
+
+        static int _open(::std::string const& path)
+        {
+            return ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        }
+
+        void _unmap() noexcept
+        {
+            if (_map != nullptr) { ::munmap(_map, _capacity); }
+            _map = nullptr;
+        }
+        /// @brief preallocate the file and map it
+        bool _map_file(u64 capacity)
+        {
+            _unmap();
+            u64 page = static_cast<u64>(::sysconf(_SC_PAGESIZE));
+            capacity = (capacity + page - 1) & ~(page - 1);
+            if (::posix_fallocate(_fd, 0, static_cast<off_t>(capacity)) != 0
+             && ::ftruncate(_fd, static_cast<off_t>(capacity)) != 0
+            ) {
+                _state |= ::std::ios::badbit;
+                return false;
+            }
+            void * map = ::mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+            if (map == MAP_FAILED)
+            {
+                _state |= ::std::ios::badbit;
+                return false;
+            }
+            _map = static_cast<u8 *>(map);
+            _capacity = capacity;
+            return true;
+        }
+
+        MmapSink(MmapSink const&) = delete;
+        MmapSink & operator =(MmapSink const&) = delete;
+
+    public:
+        /// @brief create (or truncate) the file at `path`, and preallocate `estimated_length` bytes
+        MmapSink(::std::string const& path, u64 estimated_length = 0)
+        : FdSink(_open(path), true), _map(nullptr), _capacity(0)
+        {
+            if (_state == ::std::ios::goodbit)
+            {
+                _map_file(::std::max(estimated_length, MIN_CAPACITY));
+            }
+        }
+
+        virtual ~MmapSink() override
+        {
+            flush();
+            _unmap();
+        }
+
+        virtual u8 * reserve(u64 length) override
+        {
+            if (_state != ::std::ios::goodbit) { return nullptr; }
+            if (_end + length > _capacity && !_map_file(::std::max(_end + length, _capacity * 2)))
+            {
+                return nullptr;
+            }
+            return _map + _end;
+        }
+        virtual void commit(u64 length) override
+        {
+            _end += length;
+        }
+
+        virtual void writev(iovec const* segments, u64 count) override
+        {
+            // through `write` of this sink, instead of the file descriptor directly
+            Sink::writev(segments, count);
+        }
+        virtual void write(void const* data, u64 length) override
+        {
+            if (u8 * dst = reserve(length); dst != nullptr)
+            {
+                ::std::memcpy(dst, data, length);
+                commit(length);
+            }
+        }
+        virtual void pwrite(void const* data, u64 length, u64 offset) override
+        {
+            if (_state != ::std::ios::goodbit) { return; }
+            if (offset + length > _end || offset + length < offset)
+            {
+                // only the data written before can be patched, never past the mapping
+                _state |= ::std::ios::failbit;
+                return;
+            }
+            ::std::memcpy(_map + offset, data, length);
+        }
+        /// @brief truncate the preallocated file to the real length, it is preallocated again in the next writing
+        virtual void flush() override
+        {
+            if (_map == nullptr || _capacity == _end) { return; }
+            _unmap();
+            if (::ftruncate(_fd, static_cast<off_t>(_end)) != 0)
+            {
+                _state |= ::std::ios::badbit;
+            }
+            _capacity = _end;
+            if (_end != 0 && _state == ::std::ios::goodbit)
+            {
+                // keep the mapping for the patches
+                void * map = ::mmap(nullptr, _end, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+                if (map == MAP_FAILED)
+                {
+                    _state |= ::std::ios::badbit;
+                }
+                else
+                {
+                    _map = static_cast<u8 *>(map);
+                }
+            }
+        }
+    };
+#endif
+
+#if defined(NYASZIP_POSIX) && defined(O_DIRECT)
+    /// @brief write into a file opened with `O_DIRECT` bypassing the page cache, the data is collected into aligned
+    /// blocks, the headers written before are patched by aligned read-modify-write, and the unaligned tail is written
+    /// padded then truncated. Works as a buffered file if the file system does not support `O_DIRECT`.
+    class DirectSink : public FdSink
+    {
+    public:
+        static constexpr u64 ALIGNMENT = 4 * 1024;          // 4KiB, the logical block size of most devices
+        static constexpr u64 BLOCK_LENGTH = 1024 * 1024;    // 1MiB
+
+    protected:
+        bool _direct;
+        u8 * _block;
+        u64 _filled;    // the length of data in `_block`
+        u64 _flushed;   // the offset of `_block` in file, always aligned
+        u8 * _page;     // for read-modify-write
+
+        static int _open(::std::string const& path)
+        {
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0666);
+            if (fd < 0 && errno == EINVAL)
+            {
+                fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            }
+            return fd;
+        }
+
+        void _read_modify_write(u8 const* data, u64 length, u64 offset)
+        {
+            for (u64 page = offset & ~(ALIGNMENT - 1); length != 0; page += ALIGNMENT)
+            {
+                if (::pread(_fd, _page, ALIGNMENT, static_cast<off_t>(page)) != static_cast<ssize_t>(ALIGNMENT))
+                {
+                    _state |= ::std::ios::badbit;
+                    return;
+                }
+                u64 patch_length = ::std::min(length, page + ALIGNMENT - offset);
+                ::std::memcpy(_page + (offset - page), data, patch_length);
+                FdSink::pwrite(_page, ALIGNMENT, page);
+                data += patch_length; length -= patch_length;
+                offset += patch_length;
+            }
+        }
+
+        DirectSink(DirectSink const&) = delete;
+        DirectSink & operator =(DirectSink const&) = delete;
+
+    public:
+        /// @brief create (or truncate) the file at `path`
+        DirectSink(::std::string const& path)
+        : FdSink(_open(path), true), _filled(0), _flushed(0)
+        {
+            _direct = _fd >= 0 && (::fcntl(_fd, F_GETFL) & O_DIRECT) != 0;
+            _block = static_cast<u8 *>(::operator new[](BLOCK_LENGTH, ::std::align_val_t(ALIGNMENT)));
+            _page = static_cast<u8 *>(::operator new[](ALIGNMENT, ::std::align_val_t(ALIGNMENT)));
+        }
+
+        virtual ~DirectSink() override
+        {
+            flush();
+            ::operator delete[](_block, ::std::align_val_t(ALIGNMENT));
+            ::operator delete[](_page, ::std::align_val_t(ALIGNMENT));
+        }
+
+        /// @brief the file is opened with `O_DIRECT`
+        bool direct() const noexcept
+        {
+            return _direct;
+        }
+
+        virtual void writev(iovec const* segments, u64 count) override
+        {
+            // through `write` of this sink, instead of the file descriptor directly
+            Sink::writev(segments, count);
+        }
+        virtual void write(void const* data, u64 length) override
+        {
+            auto ptr = static_cast<u8 const*>(data);
+            while (length != 0 && _state == ::std::ios::goodbit)
+            {
+                if (_filled == 0 && length >= ALIGNMENT && reinterpret_cast<uintptr_t>(ptr) % ALIGNMENT == 0)
+                {
+                    // already aligned, write without copying
+                    u64 aligned_length = length & ~(ALIGNMENT - 1);
+                    FdSink::pwrite(ptr, aligned_length, _flushed);
+                    _flushed += aligned_length;
+                    ptr += aligned_length; length -= aligned_length;
+                }
+                else
+                {
+                    u64 block_length = ::std::min(length, BLOCK_LENGTH - _filled);
+                    ::std::memcpy(_block + _filled, ptr, block_length);
+                    _filled += block_length;
+                    ptr += block_length; length -= block_length;
+                    if (_filled == BLOCK_LENGTH)
+                    {
+                        FdSink::pwrite(_block, BLOCK_LENGTH, _flushed);
+                        _flushed += BLOCK_LENGTH;
+                        _filled = 0;
+                    }
+                }
+                _end = _flushed + _filled;
+            }
+        }
+        virtual void pwrite(void const* data, u64 length, u64 offset) override
+        {
+            if (_state != ::std::ios::goodbit) { return; }
+            auto ptr = static_cast<u8 const*>(data);
+            if (offset + length > _flushed)
+            {
+                // the part still in the block
+                u64 start = ::std::max(offset, _flushed);
+                ::std::memcpy(_block + (start - _flushed), ptr + (start - offset), offset + length - start);
+                length = start - offset;
+            }
+            if (length != 0)
+            {
+                _read_modify_write(ptr, length, offset);
+            }
+        }
+        /// @brief write the block padded to the alignment, and truncate the file to the real length,
+        /// the block is kept and written again when it is full
+        virtual void flush() override
+        {
+            if (_filled == 0 || _state != ::std::ios::goodbit) { return; }
+            FdSink::pwrite(_block, (_filled + ALIGNMENT - 1) & ~(ALIGNMENT - 1), _flushed);
+            if (::ftruncate(_fd, static_cast<off_t>(_end)) != 0)
+            {
+                _state |= ::std::ios::badbit;
+            }
+        }
+    };
+#endif
+
+#ifdef NYASZIP_IO_URING
+    /// @brief write into a file through io_uring (linux), several blocks are kept in flight, so the compression and
+    /// encryption of the next block overlap the writing of the previous ones. The headers are patched by positional
+    /// writes that only wait for the blocks in flight under them. Works as `FdSink` if io_uring is unavailable.
+    class UringSink : public FdSink
+    {
+    public:
+        static constexpr u32 DEPTH = 4;                     // the number of blocks in flight
+        static constexpr u64 BLOCK_LENGTH = 1024 * 1024;    // 1MiB
+
+    protected:
+        struct Block
+        {
+            u8 * data;
+            iovec vec;
+            u64 offset;
+            bool busy;
+        };
+        struct Patch
+        {
+            ::std::vector<u8> data;
+            iovec vec;
+            u64 offset;
+        };
+
+        int _ring;
+        u32 _entries;       // the length of submission queue
+        u32 _inflight;
+        void * _sq_ring;
+        void * _cq_ring;
+        void * _sqes_ring;
+        u64 _sq_ring_length;
+        u64 _cq_ring_length;
+        u64 _sqes_ring_length;
+        u32 * _sq_tail;
+        u32 * _sq_array;
+        u32 _sq_mask;
+        io_uring_sqe * _sqes;
+        u32 * _cq_head;
+        u32 * _cq_tail;
+        u32 _cq_mask;
+        io_uring_cqe * _cqes;
+
+        ::std::vector<Block> _blocks;
+        u32 _next_block;
+        ::std::unordered_map<u64, Patch> _patches;  // user data -> patch
+        u64 _next_patch;
+
+        void _setup(u32 depth)
+        {
+            _ring = -1;
+            _entries = _inflight = 0;
+            _sq_ring = _cq_ring = _sqes_ring = MAP_FAILED;
+            _next_block = 0;
+            _next_patch = depth = ::std::max(depth, static_cast<u32>(1));
+            if (_state != ::std::ios::goodbit) { return; }
+
+            io_uring_params params;
+            ::std::memset(&params, 0, sizeof(params));
+            _ring = static_cast<int>(::syscall(__NR_io_uring_setup, depth * 2, &params));
+            if (_ring < 0) { return; }  // unavailable, like old kernels or blocked by seccomp
+
+            _sq_ring_length = params.sq_off.array + params.sq_entries * sizeof(u32);
+            _cq_ring_length = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            _sqes_ring_length = params.sq_entries * sizeof(io_uring_sqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap)
+            {
+                _sq_ring_length = _cq_ring_length = ::std::max(_sq_ring_length, _cq_ring_length);
+            }
+            _sq_ring = ::mmap(nullptr, _sq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQ_RING);
+            _cq_ring = single_mmap ? _sq_ring
+                     : ::mmap(nullptr, _cq_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_CQ_RING);
+            _sqes_ring = ::mmap(nullptr, _sqes_ring_length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring, IORING_OFF_SQES);
+            if (_sq_ring == MAP_FAILED || _cq_ring == MAP_FAILED || _sqes_ring == MAP_FAILED)
+            {
+                _teardown();
+                return;
+            }
+
+            u8 * sq = static_cast<u8 *>(_sq_ring);
+            u8 * cq = static_cast<u8 *>(_cq_ring);
+            _sq_tail  = reinterpret_cast<u32 *>(sq + params.sq_off.tail);
+            _sq_array = reinterpret_cast<u32 *>(sq + params.sq_off.array);
+            _sq_mask  = *reinterpret_cast<u32 *>(sq + params.sq_off.ring_mask);
+            _sqes     = static_cast<io_uring_sqe *>(_sqes_ring);
+            _cq_head  = reinterpret_cast<u32 *>(cq + params.cq_off.head);
+            _cq_tail  = reinterpret_cast<u32 *>(cq + params.cq_off.tail);
+            _cq_mask  = *reinterpret_cast<u32 *>(cq + params.cq_off.ring_mask);
+            _cqes     = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+            _entries = params.sq_entries;
+
+            _blocks.resize(depth);
+            for (Block & block : _blocks)
+            {
+                block.data = static_cast<u8 *>(::operator new[](BLOCK_LENGTH, ::std::align_val_t(4096)));
+                block.busy = false;
+            }
+        }
+        void _teardown() noexcept
+        {
+            if (_sqes_ring != MAP_FAILED) { ::munmap(_sqes_ring, _sqes_ring_length); }
+            if (_cq_ring != MAP_FAILED && _cq_ring != _sq_ring) { ::munmap(_cq_ring, _cq_ring_length); }
+            if (_sq_ring != MAP_FAILED) { ::munmap(_sq_ring, _sq_ring_length); }
+            _sq_ring = _cq_ring = _sqes_ring = MAP_FAILED;
+            if (_ring >= 0) { ::close(_ring); }
+            _ring = -1;
+
+            for (Block & block : _blocks)
+            {
+                ::operator delete[](block.data, ::std::align_val_t(4096));
+            }
+            _blocks.clear();
+        }
+
+        /// @brief handle the completions posted already, return the number of them
+        u32 _reap()
+        {
+            u32 head = *_cq_head;
+            u32 tail = ::std::atomic_ref<u32>(*_cq_tail).load(::std::memory_order_acquire);
+            for (u32 idx = head; idx != tail; idx++)
+            {
+                io_uring_cqe const& cqe = _cqes[idx & _cq_mask];
+                _complete(cqe.user_data, cqe.res);
+            }
+            ::std::atomic_ref<u32>(*_cq_head).store(tail, ::std::memory_order_release);
+            return tail - head;
+        }
+        /// @brief wait for at least one completion, return false if failed
+        bool _wait()
+        {
+            while (_reap() == 0)
+            {
+                if (::syscall(__NR_io_uring_enter, _ring, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 && errno != EINTR)
+                {
+                    _state |= ::std::ios::badbit;
+                    return false;
+                }
+            }
+            return true;
+        }
+        void _complete(u64 user_data, i32 res)
+        {
+            _inflight--;
+            iovec * vec;
+            u64 offset;
+            if (user_data < _blocks.size())
+            {
+                Block & block = _blocks[user_data];
+                block.busy = false;
+                vec = &block.vec;
+                offset = block.offset;
+            }
+            else
+            {
+                Patch & patch = _patches.at(user_data);
+                vec = &patch.vec;
+                offset = patch.offset;
+            }
+
+            if (res < 0)
+            {
+                _state |= ::std::ios::badbit;
+            }
+            else if (static_cast<u64>(res) < vec->iov_len)
+            {
+                // short write, finish it synchronously
+                FdSink::pwrite(static_cast<u8 *>(vec->iov_base) + res, vec->iov_len - res, offset + res);
+            }
+            if (user_data >= _blocks.size()) { _patches.erase(user_data); }
+        }
+        /// @brief submit a positional write, `vec` must be alive until completed
+        void _submit(iovec const* vec, u64 offset, u64 user_data, u8 flags)
+        {
+            while (_inflight >= _entries)
+            {
+                if (!_wait()) { return; }
+            }
+
+            u32 tail = *_sq_tail;
+            u32 index = tail & _sq_mask;
+            io_uring_sqe * sqe = _sqes + index;
+            ::std::memset(sqe, 0, sizeof(io_uring_sqe));
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->flags = flags;
+            sqe->fd = _fd;
+            sqe->off = offset;
+            sqe->addr = reinterpret_cast<u64>(vec);
+            sqe->len = 1;
+            sqe->user_data = user_data;
+            _sq_array[index] = index;
+            ::std::atomic_ref<u32>(*_sq_tail).store(tail + 1, ::std::memory_order_release);
+            _inflight++;
+
+            while (::syscall(__NR_io_uring_enter, _ring, 1, 0, 0, nullptr, 0) < 0)
+            {
+                if (errno == EINTR) { continue; }
+                if ((errno == EAGAIN || errno == EBUSY) && _wait()) { continue; }
+                // not consumed by the kernel, take it back
+                ::std::atomic_ref<u32>(*_sq_tail).store(tail, ::std::memory_order_release);
+                _inflight--;
+                _state |= ::std::ios::badbit;
+                return;
+            }
+        }
+
+        UringSink(UringSink const&) = delete;
+        UringSink & operator =(UringSink const&) = delete;
+
+    public:
+        /// @brief write into `fd` from its current offset, with `depth` blocks in flight
+        UringSink(int fd, bool owned_fd = false, u32 depth = DEPTH)
+        : FdSink(fd, owned_fd)
+        {
+            _setup(depth);
+        }
+        /// @brief create (or truncate) the file at `path`, with `depth` blocks in flight
+        UringSink(::std::string const& path, u32 depth = DEPTH)
+        : FdSink(path)
+        {
+            _setup(depth);
+        }
+
+        virtual ~UringSink() override
+        {
+            flush();
+            _teardown();
+        }
+
+        /// @brief the writing is asynchronous, false if io_uring is unavailable
+        bool async() const noexcept
+        {
+            return _ring >= 0;
+        }
+
+        /// @brief the length of the free blocks in order from the next one
+        virtual u64 writable() override
+        {
+            if (_ring < 0 || _inflight == 0 || _state != ::std::ios::goodbit) { return Sink::writable(); }
+
+            u64 length = 0;
+            for (u64 idx = 0; idx < _blocks.size() && !_blocks[(_next_block + idx) % _blocks.size()].busy; idx++)
+            {
+                length += BLOCK_LENGTH;
+            }
+            return length;
+        }
+        virtual bool poll() override
+        {
+            return _ring >= 0 && _reap() != 0;
+        }
+        /// @brief the ring is readable when there are completions
+        virtual int event_fd() const override
+        {
+            return _ring;
+        }
+
+        virtual void writev(iovec const* segments, u64 count) override
+        {
+            // through `write` of this sink, instead of the file descriptor directly
+            Sink::writev(segments, count);
+        }
+        virtual void write(void const* data, u64 length) override
+        {
+            if (_ring < 0) { FdSink::write(data, length); return; }
+
+            auto ptr = static_cast<u8 const*>(data);
+            while (length != 0 && _state == ::std::ios::goodbit)
+            {
+                Block & block = _blocks[_next_block];
+                while (block.busy)
+                {
+                    if (!_wait()) { return; }
+                }
+                u64 block_length = ::std::min(length, BLOCK_LENGTH);
+                ::std::memcpy(block.data, ptr, block_length);
+                block.vec = {block.data, block_length};
+                block.offset = _end;
+                block.busy = true;
+                _submit(&block.vec, _end, _next_block, 0);
+
+                _end += block_length;
+                ptr += block_length; length -= block_length;
+                _next_block = (_next_block + 1) % _blocks.size();
+            }
+        }
+        virtual void pwrite(void const* data, u64 length, u64 offset) override
+        {
+            if (_ring < 0) { FdSink::pwrite(data, length, offset); return; }
+            if (_state != ::std::ios::goodbit) { return; }
+
+            // only the blocks in flight under the patched region are waited for, so it is not overwritten by them,
+            // the other writes keep going (a link cannot be made to the writes already submitted)
+            for (Block const& block : _blocks)
+            {
+                while (block.busy && block.offset < offset + length && offset < block.offset + block.vec.iov_len)
+                {
+                    if (!_wait()) { return; }
+                }
+            }
+            u64 user_data = _next_patch++;
+            Patch & patch = _patches[user_data];
+            patch.data.assign(static_cast<u8 const*>(data), static_cast<u8 const*>(data) + length);
+            patch.vec = {patch.data.data(), length};
+            patch.offset = offset;
+            _submit(&patch.vec, offset, user_data, 0);
+        }
+        virtual void flush() override
+        {
+            while (_ring >= 0 && _inflight != 0)
+            {
+                if (!_wait()) { return; }
+            }
+        }
+    };
+#endif
+
+    /// @brief keep the data in memory, and spill it into a temporary file (`tmpfile()`) if it is too long
+    class StagingSink : public Sink
+    {
+    protected:
+        ::std::vector<u8> _data;
+        ::std::FILE * _spill;
+        u64 _spilled;       // the length of data in `_spill`, before `_data`
+        u64 _spill_length;  // 0 for never spilling
+        ::std::ios::iostate _state;
+
+        StagingSink(StagingSink const&) = delete;
+        StagingSink & operator =(StagingSink const&) = delete;
+
+        bool _seek(u64 offset)
+        {
+#if defined(_WIN32)
+            return ::_fseeki64(_spill, static_cast<__int64>(offset), SEEK_SET) == 0;
+#elif defined(NYASZIP_POSIX)
+            return ::fseeko(_spill, static_cast<off_t>(offset), SEEK_SET) == 0;
+#else
+            return ::std::fseek(_spill, static_cast<long>(offset), SEEK_SET) == 0;
+#endif
+        }
+        void _spill_data()
+        {
+            if (_spill == nullptr) { _spill = ::std::tmpfile(); }
+            if (_spill == nullptr || ::std::fwrite(_data.data(), 1, _data.size(), _spill) != _data.size())
+            {
+                _state |= ::std::ios::badbit;
+                return;
+            }
+            _spilled += _data.size();
+            _data.clear();
+        }
+
+    public:
+        StagingSink(u64 spill_length)
+        : _data(), _spill(nullptr), _spilled(0), _spill_length(spill_length), _state(::std::ios::goodbit) {}
+
+        virtual ~StagingSink() override
+        {
+            if (_spill != nullptr) { ::std::fclose(_spill); }
+        }
+
+        virtual void write(void const* data, u64 length) override
+        {
+            if (_state != ::std::ios::goodbit) { return; }
+            auto ptr = static_cast<u8 const*>(data);
+            _data.insert(_data.end(), ptr, ptr + length);
+            if (_spill_length != 0 && _data.size() >= _spill_length) { _spill_data(); }
+        }
+        virtual void pwrite(void const* data, u64 length, u64 offset) override
+        {
+            if (_state != ::std::ios::goodbit) { return; }
+            if (offset + length > tell() || offset + length < offset)
+            {
+                _state |= ::std::ios::failbit;
+                return;
+            }
+            auto ptr = static_cast<u8 const*>(data);
+            if (offset < _spilled)
+            {
+                u64 spill_length = ::std::min(length, _spilled - offset);
+                if (!_seek(offset) || ::std::fwrite(ptr, 1, spill_length, _spill) != spill_length || !_seek(_spilled))
+                {
+                    _state |= ::std::ios::badbit;
+                    return;
+                }
+                ptr += spill_length; length -= spill_length;
+                offset += spill_length;
+            }
+            ::std::memcpy(_data.data() + (offset - _spilled), ptr, length);
+        }
+        virtual u64 tell() override
+        {
+            return _spilled + _data.size();
+        }
+        virtual void flush() override
+        {
+            if (_spill != nullptr && ::std::fflush(_spill) != 0) { _state |= ::std::ios::badbit; }
+        }
+        virtual ::std::ios::iostate rdstate() const override
+        {
+            return _state;
+        }
+
+        /// @brief the spilled data, read from the start after flushing, nullptr if not spilled
+        ::std::FILE * spill() noexcept
+        {
+            return _spill;
+        }
+        u64 spilled() const noexcept
+        {
+            return _spilled;
+        }
+        /// @brief the data in memory, after the spilled data
+        ::std::vector<u8> const& data() const noexcept
+        {
+            return _data;
+        }
+        /// @brief read the data written at `offset` (from the start of sink), return false if failed
+        bool read(void * data, u64 length, u64 offset)
+        {
+            if (offset + length > tell()) { return false; }
+            auto ptr = static_cast<u8 *>(data);
+            if (offset < _spilled)
+            {
+                u64 spill_length = ::std::min(length, _spilled - offset);
+                if (!_seek(offset) || ::std::fread(ptr, 1, spill_length, _spill) != spill_length || !_seek(_spilled))
+                {
+                    return false;
+                }
+                ptr += spill_length; length -= spill_length;
+                offset += spill_length;
+            }
+            ::std::memcpy(ptr, _data.data() + (offset - _spilled), length);
+            return true;
+        }
+        /// @brief drop all data
+        void clear()
+        {
+            if (_spill != nullptr) { ::std::fclose(_spill); }
+            _spill = nullptr;
+            _spilled = 0;
+            _data.clear();
+            _state = ::std::ios::goodbit;
+        }
+    };
+
+    /// @brief the coroutine of asynchronous writing, started when it is awaited by another coroutine or by
+    /// `start()`. the exception thrown inside is rethrown by `co_await` or `get()`
+    class Task
+    {
+    public:
+        struct promise_type;
+        using handle_type = ::std::coroutine_handle<promise_type>;
+
+        /// @brief resume the awaiting coroutine when finished
+        struct FinalAwaiter
+        {
+            bool await_ready() const noexcept
+            {
+                return false;
+            }
+            ::std::coroutine_handle<> await_suspend(handle_type handle) noexcept
+            {
+                auto continuation = handle.promise().continuation;
+                return continuation ? continuation : ::std::noop_coroutine();
+            }
+            void await_resume() const noexcept
+            {}
+        };
+        struct promise_type
+        {
+            ::std::coroutine_handle<> continuation;
+            ::std::exception_ptr exception;
+
+            Task get_return_object() noexcept
+            {
+                return Task(handle_type::from_promise(*this));
+            }
+            ::std::suspend_always initial_suspend() const noexcept
+            {
+                return {};
+            }
+            FinalAwaiter final_suspend() const noexcept
+            {
+                return {};
+            }
+            void return_void() const noexcept
+            {}
+            void unhandled_exception() noexcept
+            {
+                exception = ::std::current_exception();
+            }
+        };
+
+    protected:
+        handle_type _handle;
+        bool _started;
+
+        Task(handle_type handle_) noexcept
+        : _handle(handle_), _started(false) {}
+
+        Task(Task const&) = delete;
+        Task & operator =(Task const&) = delete;
+
+    public:
+        Task(Task && other) noexcept
+        : _handle(::std::exchange(other._handle, nullptr)), _started(other._started) {}
+
+        ~Task()
+        {
+            if (_handle) { _handle.destroy(); }
+        }
+
+        /// @brief run the coroutine until it is suspended or done, only for the first time
+        Task & start()
+        {
+            if (!_started)
+            {
+                _started = true;
+                _handle.resume();
+            }
+            return *this;
+        }
+        bool done() const noexcept
+        {
+            return _handle.done();
+        }
+        /// @brief rethrow the exception if the coroutine is done with it
+        void get() const
+        {
+            if (_handle.done() && _handle.promise().exception) { ::std::rethrow_exception(_handle.promise().exception); }
+        }
+
+        bool await_ready() const noexcept
+        {
+            return _handle.done();
+        }
+        ::std::coroutine_handle<> await_suspend(::std::coroutine_handle<> awaiting) noexcept
+        {
+            _handle.promise().continuation = awaiting;
+            if (_started) { return ::std::noop_coroutine(); }
+            _started = true;
+            return _handle;
+        }
+        void await_resume() const
+        {
+            get();
+        }
+    };
+
+    class Zip
+    {
+    public:
+        static constexpr u64 BUFFER_LENGTH = 1024 * 1024;       // 1MiB by default
+        static constexpr u64 BUFFER_ALIGNMENT = 4 * 1024;       // 4KiB pages by default
+        static constexpr u64 MIN_BUFFER_LENGTH = 4 * 1024;      // 4KiB
+        static constexpr u64 PATCH_BATCH = 4096;                // entries
+        static constexpr u64 CENTRAL_SPILL = 64 * 1024 * 1024;  // 64MiB
+
+        class CentralSpillException : public exception
+        {
+        public:
+            virtual char const* what() const noexcept override
+            {
+                return "cannot spill the central directory into the temporary file";
+            }
+
+            static void check(bool success)
+            {
+                if (!success) { throw CentralSpillException(); }
+            }
+        };
+        class AlignmentException : public exception
+        {
+        public:
+            virtual char const* what() const noexcept override
+            {
+                return "the data alignment must be 0 or a power of 2 (not greater than 32768)";
+            }
+
+            static void check(u16 alignment)
+            {
+                if (alignment != 0 && !::std::has_single_bit(alignment)) { throw AlignmentException(); }
+            }
+        };
+        class WaitingException : public exception
+        {
+        public:
+            virtual char const* what() const noexcept override
+            {
+                return "another coroutine is waiting for the sink of this zip, only one coroutine can write into a zip";
+            }
+
+            static void check(bool waiting)
+            {
+                if (waiting) { throw WaitingException(); }
+            }
+        };
+        class StagingException : public exception
+        {
+        public:
+            virtual char const* what() const noexcept override
+            {
+                return "cannot stage the file in the memory or the temporary file";
+            }
+
+            static void check(bool success)
+            {
+                if (!success) { throw StagingException(); }
+            }
+        };
+
+        /// @brief create a zip file at `path`, written through a file descriptor if POSIX is available
+        static Zip create(::std::string const& path)
+        {
+#ifdef NYASZIP_POSIX
+            return Zip(*new FdSink(path), true);
+#else
+            auto output_ = new ::std::ofstream(path, ::std::ios::trunc | ::std::ios::binary);
+            return Zip(*output_, true);
+#endif
+        }
+
+    protected:
+        friend class LocalFile;
+        friend class StagedZip;
+
+        Sink * _sink;
+        bool _owned_sink;
+        WritingState _state;
+        i64 _offset;        // zip start
+
+        bool _zip64;
+        LocalFile * _current;   // only the current file is kept, the closed ones are in `_central`
+        u64 _entries;
+        ::std::string _comment;
+        PCG_XSH_RR _random;
+        u8 * _buffer;       // all writing must pass through this buffer
+        u8 * _staging;      // the writes are coalesced here before going into the sink
+        u64 _staged;
+        bool _reserved_in_sink;
+        u64 _buffer_length; // the length of both `_buffer` and `_staging`
+        u64 _buffer_alignment;
+        bool _streaming;
+        bool _adaptive;
+        AdaptiveLevel _adaptive_level;
+
+        /// @brief a patch on the data already in the sink, the data is in `_patch_data`
+        struct Patch
+        {
+            u64 position;
+            u64 length;
+            u64 data;
+        };
+        ::std::vector<Patch> _patches;
+        ::std::vector<u8> _patch_data;
+        u64 _patch_batch;   // entries closed between the batches, 0 for only when flushing
+        u64 _unpatched;     // entries closed since the last batch
+        ::std::vector<u8> _central; // the central directory headers of the closed files
+        u64 _spill_threshold;       // 0 for never spilling
+        // the idle ciphers (for AES-128/192/256) and compression, reused by the next files
+        AbstractZipAES * _aes_pool[3];
+        AbstractCompression * _cmpr_pool;
+        ::std::mutex _mutex;    // for appending the files from `StagedZip`
+        ::std::coroutine_handle<> _waiting; // the coroutine waiting for the sink
+        u64 _waiting_length;
+        u16 _data_alignment;    // of stored files without encryption, 0 or 1 for not aligned
+        ::std::FILE * _spill;       // the spilled central directory headers, before those in `_central`
+        u64 _spilled;
+
+        Zip(Zip const&) = delete;
+        Zip & operator =(Zip const&) = delete;
+
+        void _init()
+        {
+            _state = WritingState::Writing;
+            _offset = static_cast<i64>(_sink->tell());
+
+            _zip64 = false;
+            _comment = "";
+            _streaming = !_sink->seekable();
+            _adaptive = false;
+            _buffer_length = BUFFER_LENGTH;
+            _buffer_alignment = BUFFER_ALIGNMENT;
+            _buffer = _allocate(_buffer_length, _buffer_alignment);
+            _staging = _allocate(_buffer_length, _buffer_alignment);
+            _staged = 0;
+            _reserved_in_sink = false;
+            _patch_batch = PATCH_BATCH;
+            _unpatched = 0;
+            _spill_threshold = 0;
+            _spill = nullptr;
+            _spilled = 0;
+            _aes_pool[0] = _aes_pool[1] = _aes_pool[2] = nullptr;
+            _cmpr_pool = nullptr;
+            _waiting = nullptr;
+            _waiting_length = 0;
+            _data_alignment = 0;
+        }
+
+        static u8 * _allocate(u64 length, u64 alignment)
+        {
+            return static_cast<u8 *>(::operator new[](length, ::std::align_val_t(alignment)));
+        }
+        static void _deallocate(u8 * buffer, u64 alignment) noexcept
+        {
+            ::operator delete[](buffer, ::std::align_val_t(alignment));
+        }
+
+        void _gen_salt(u8 * salt, u64 length)
+        {
+            _random.gen(salt, length);
+        }
+        /// @brief an idle cipher if any, the keys are generated again by `set` anyway
+        template<u16 bits> AbstractZipAES * _acquire_aes()
+        {
+            AbstractZipAES * aes = ::std::exchange(_aes_pool[bits / 64 - 2], nullptr);
+            return aes != nullptr ? aes : new ZipAES<bits>;
+        }
+        void _release_aes(AbstractZipAES * aes)
+        {
+            if (aes == nullptr) { return; }
+            delete ::std::exchange(_aes_pool[aes->bits() / 64 - 2], aes);
+        }
+        BZip2Compression * _acquire_bzip2(u8 level, u32 threads)
+        {
+            if (auto bzip2 = dynamic_cast<BZip2Compression *>(_cmpr_pool); bzip2 != nullptr)
+            {
+                _cmpr_pool = nullptr;
+                return &bzip2->reset(level, threads);
+            }
+            return new BZip2Compression(level, threads);
+        }
+        void _release_cmpr(AbstractCompression * cmpr)
+        {
+            if (cmpr == nullptr) { return; }
+            delete ::std::exchange(_cmpr_pool, cmpr);
+        }
+        /// @brief call `io` to write `length` bytes into the sink, timed for the adaptive level if `timed`.
+        /// The writes of file data are timed (selected with the pipeline), the headers are not.
+        template<bool timed, typename F> void _sink_io(u64 length, F && io)
+        {
+            using clock = ::std::chrono::steady_clock;
+            if constexpr (!timed) { io(); }
+            else
+            {
+                auto t0 = clock::now();
+                io();
+                _adaptive_level.wrote(length, ::std::chrono::duration<double>(clock::now() - t0).count());
+            }
+        }
+        template<bool timed = false> void _flush_staging()
+        {
+            if (_staged != 0)
+            {
+                _sink_io<timed>(_staged, [&] { _sink->write(_staging, _staged); });
+                _staged = 0;
+            }
+        }
+        /// @brief the memory to write the next `length` bytes (not greater than `_buffer_length`) directly,
+        /// in the sink if supported, otherwise in the staging area. Call `_commit` after filling it.
+        template<bool timed = false> u8 * _reserve(u64 length)
+        {
+            if (_staged + length > _buffer_length) { _flush_staging<timed>(); }
+            if (_staged == 0)
+            {
+                if (u8 * mapped = _sink->reserve(length); mapped != nullptr)
+                {
+                    _reserved_in_sink = true;
+                    return mapped;
+                }
+            }
+            _reserved_in_sink = false;
+            return _staging + _staged;
+        }
+        template<bool timed = false> void _commit(u64 length)
+        {
+            if (_reserved_in_sink)
+            {
+                _sink_io<timed>(length, [&] { _sink->commit(length); });
+                return;
+            }
+            _staged += length;
+            if (_staged == _buffer_length) { _flush_staging<timed>(); }
+        }
+        template<bool timed = false> void _write(void const* data, u64 length)
+        {
+            auto ptr = static_cast<u8 const*>(data);
+            if (u8 * dst = _staged == 0 ? _sink->reserve(length) : nullptr; dst != nullptr)
+            {
+                // the copy goes into the sink memory, so it is a part of the output
+                _sink_io<timed>(length, [&] {
+                    ::std::memcpy(dst, ptr, length);
+                    _sink->commit(length);
+                });
+                return;
+            }
+            while (length != 0)
+            {
+                if (length >= _buffer_length)
+                {
+                    // large enough, no need to coalesce, the staged data goes in the same write
+                    iovec segments[2] = {{_staging, _staged}, {const_cast<u8 *>(ptr), length}};
+                    _sink_io<timed>(_staged + length, [&] {
+                        _sink->writev(segments + (_staged == 0 ? 1 : 0), _staged == 0 ? 1 : 2);
+                    });
+                    _staged = 0;
+                    return;
+                }
+                u64 staging_length = ::std::min(length, _buffer_length - _staged);
+                ::std::memcpy(_staging + _staged, ptr, staging_length);
+                _staged += staging_length;
+                ptr += staging_length; length -= staging_length;
+                if (_staged == _buffer_length) { _flush_staging<timed>(); }
+            }
+        }
+        /// @brief write the segments of `length` bytes in total, the large ones are written into the sink
+        /// together with the staged data by one writev, otherwise coalesced
+        template<bool timed = false> void _writev(iovec const* segments, u64 count, u64 length)
+        {
+            if (_staged + length < _buffer_length)
+            {
+                for (u64 idx = 0; idx < count; idx++) { _write<timed>(segments[idx].iov_base, segments[idx].iov_len); }
+                return;
+            }
+            if (_staged == 0)
+            {
+                _sink_io<timed>(length, [&] { _sink->writev(segments, count); });
+                return;
+            }
+            ::std::vector<iovec> gathered;
+            gathered.reserve(count + 1);
+            gathered.push_back({_staging, _staged});
+            gathered.insert(gathered.end(), segments, segments + count);
+            _sink_io<timed>(_staged + length, [&] { _sink->writev(gathered.data(), gathered.size()); });
+            _staged = 0;
+        }
+        void _write_buffer(u8 * const end)
+        {
+            _write_buffer(end - _buffer);
+        }
+        void _write_buffer(u64 length)
+        {
+            _write(_buffer, length);
+        }
+        /// @brief overwrite the data at `offset_` from zip start, the data still in staging is patched in memory,
+        /// and the patches on the data in sink are deferred to `_apply_patches`
+        void _pwrite(void const* data, u64 length, u64 offset_)
+        {
+            auto ptr = static_cast<u8 const*>(data);
+            u64 pos = _offset + offset_;
+            u64 sink_end = _sink->tell();
+            if (pos < sink_end)
+            {
+                u64 sink_length = ::std::min(length, sink_end - pos);
+                _patches.push_back({pos, sink_length, _patch_data.size()});
+                _patch_data.insert(_patch_data.end(), ptr, ptr + sink_length);
+                ptr += sink_length; pos += sink_length; length -= sink_length;
+            }
+            if (length != 0)
+            {
+                ::std::memcpy(_staging + (pos - sink_end), ptr, length);
+            }
+        }
+        void _pwrite_buffer(u8 * const end, u64 offset_)
+        {
+            _pwrite(_buffer, end - _buffer, offset_);
+        }
+        /// @brief write the deferred patches into sink in one batch, sorted by position, and the adjacent or
+        /// overlapping patches are merged into one write (the later patch wins in the overlapped part)
+        void _apply_patches()
+        {
+            if (_patches.empty()) { return; }
+
+            ::std::vector<u64> order(_patches.size());
+            for (u64 idx = 0; idx < order.size(); idx++) { order[idx] = idx; }
+            ::std::stable_sort(order.begin(), order.end(), [this](u64 a, u64 b) {
+                return _patches[a].position < _patches[b].position;
+            });
+
+            ::std::vector<u8> run;
+            for (u64 begin = 0; begin < order.size();)
+            {
+                u64 run_position = _patches[order[begin]].position;
+                u64 run_end = run_position;
+                u64 end = begin;
+                for (; end < order.size() && _patches[order[end]].position <= run_end; end++)
+                {
+                    Patch const& patch = _patches[order[end]];
+                    run_end = ::std::max(run_end, patch.position + patch.length);
+                }
+
+                // in the recorded order, so the later patches overwrite the earlier ones
+                ::std::sort(order.begin() + begin, order.begin() + end);
+                run.resize(run_end - run_position);
+                for (u64 idx = begin; idx < end; idx++)
+                {
+                    Patch const& patch = _patches[order[idx]];
+                    ::std::memcpy(run.data() + (patch.position - run_position), _patch_data.data() + patch.data, patch.length);
+                }
+                _sink->pwrite(run.data(), run.size(), run_position);
+                begin = end;
+            }
+
+            _patches.clear();
+            _patch_data.clear();
+            _unpatched = 0;
+        }
+        /// @brief an entry is closed, apply the patches if there are enough entries
+        void _entry_closed()
+        {
+            _unpatched++;
+            if (_patch_batch != 0 && _unpatched >= _patch_batch) { _apply_patches(); }
+        }
+        /// @brief move the central directory headers into the temporary file if there are too many,
+        /// only when the headers cannot be changed anymore
+        void _spill_central()
+        {
+            if (_spill_threshold == 0 || _central.size() < _spill_threshold) { return; }
+            if (_spill == nullptr)
+            {
+                _spill = ::std::tmpfile();
+                CentralSpillException::check(_spill != nullptr);
+            }
+            CentralSpillException::check(::std::fwrite(_central.data(), 1, _central.size(), _spill) == _central.size());
+            _spilled += _central.size();
+            _central.clear();
+        }
+        i64 _tellp()
+        {
+            return static_cast<i64>(_sink->tell() + _staged) - _offset;
+        }
+        void _commit_staged(Zip & staging, StagingSink & sink);  // append the closed file in `staging`
+
+        /// @brief suspend the coroutine until the sink can take `length` bytes without waiting, see `poll()`
+        struct WritableAwaiter
+        {
+            Zip & zip;
+            u64 length;
+
+            bool await_ready() const
+            {
+                return zip._sink->writable() >= length;
+            }
+            /// @brief throw `WaitingException` into the coroutine if another one is waiting, instead of dropping it
+            void await_suspend(::std::coroutine_handle<> handle)
+            {
+                WaitingException::check(static_cast<bool>(zip._waiting));
+                zip._waiting = handle;
+                zip._waiting_length = length;
+            }
+            void await_resume() const noexcept
+            {}
+        };
+        /// @brief wait until the sink can take the staged data and the next `_buffer_length` bytes
+        WritableAwaiter _writable()
+        {
+            return {*this, 2 * _buffer_length};
+        }
+
+        ::std::tuple<u64, u64> _write_central_direction();  // -> (cd_size, cd_offset)
+        u64 _write_zip64_record(u64 cd_size, u64 cd_offset) // -> record offset
+        {
+            u64 record_offset = ::std::bit_cast<u64>(_tellp());
+
+            u8 * record = _buffer;
+            _write_into<u32>(record, 0x06064B50);
+            _write_into<u64>(record, 44);
+            _write_into<u16>(record, VersionMadeOf);
+            _write_into<u16>(record, VersionNeedToExtra::Zip64);
+            _write_into<u32>(record, 0 /* number of this disk */);
+            _write_into<u32>(record, 0 /* number of the disk with the start of the central directory */);
+            _write_into<u64>(record, _entries /* total number of entries in the central directory on this disk */);
+            _write_into<u64>(record, _entries /* total number of entries in the central directory */);
+            _write_into<u64>(record, cd_size);
+            _write_into<u64>(record, cd_offset);
+            _write_buffer(record);
+
+            return record_offset;
+        }
+        void _write_zip64_locator(u64 record_offset)
+        {
+            u8 * locator = _buffer;
+            _write_into<u32>(locator, 0x07064B50);
+            _write_into<u32>(locator, 0 /* number of the disk with the start of the zip64 end of central directory */);
+            _write_into<u64>(locator, record_offset);
+            _write_into<u32>(locator, 1 /* total number of disks */);
+            _write_buffer(locator);
+        }
+        void _write_end_of_central_direction(u64 cd_size, u64 cd_offset)
+        {
+            u16 total_files = ::std::min(static_cast<u64>(0xFFFF), _entries);
+            cd_size =     ::std::min(static_cast<u64>(0xFFFFFFFF), cd_size);
+            cd_offset =   ::std::min(static_cast<u64>(0xFFFFFFFF), cd_offset);
+            u16 comment_length = _comment.size() & 0xFFFF;
+
+            u8 * end = _buffer;
+            _write_into<u32>(end, 0x06054B50);
+            _write_into<u16>(end, 0 /* number of this disk */);
+            _write_into<u16>(end, 0 /* number of the disk with the start of the central directory */);
+            _write_into<u16>(end, total_files /* total number of entries in the central directory on this disk */);
+            _write_into<u16>(end, total_files /* total number of entries in the central directory */);
+            _write_into<u32>(end, static_cast<u32>(cd_size));
+            _write_into<u32>(end, static_cast<u32>(cd_offset));
+            _write_into<u16>(end, comment_length);
+            _write_buffer(end);
+
+            _write(_comment.c_str(), comment_length);
+        }
+
+    public:
+        Zip(::std::ostream & output_, bool owned_output_ = false)
+        : _sink(new OStreamSink(output_, owned_output_)), _owned_sink(true), _current(nullptr), _entries(0), _random() {
+            _init();
+        }
+        Zip(Sink & sink_, bool owned_sink_ = false)
+        : _sink(::std::addressof(sink_)), _owned_sink(owned_sink_), _current(nullptr), _entries(0), _random() {
+            _init();
+        }
+
+        ~Zip();
+
+        Sink & sink() noexcept
+        {
+            return *_sink;
+        }
+        Sink const& sink() const noexcept
+        {
+            return *_sink;
+        }
+
+        /* from _sink */
+
+        bool good() const
+        {
+            return _sink->good();
         }
         bool fail() const
         {
-            return _output->fail();
+            return _sink->fail();
         }
         bool bad() const
         {
-            return _output->bad();
+            return _sink->bad();
         }
         auto rdstate() const
         {
-            return _output->rdstate();
+            return _sink->rdstate();
         }
 
         WritingState state() const noexcept
@@ -1483,24 +3710,146 @@ namespace nyaszip
             return *this;
         }
 
+        bool streaming() const noexcept
+        {
+            return _streaming;
+        }
+        /// @brief never patch what is written, the crc32 & sizes of files are written in data descriptors after
+        /// the data instead of the local headers, enabled if the sink is not seekable (like pipes)
+        Zip & streaming(bool enable)
+        {
+            ensure<WritingState::Writing>::check(_state);
+            _streaming = enable || !_sink->seekable();
+            return *this;
+        }
+        u16 data_alignment() const noexcept
+        {
+            return _data_alignment;
+        }
+        /// @brief pad the local extra field of stored files without encryption, so their data starts at the multiple
+        /// of `alignment` (from the start of zip, like 4096 for mmap pages), 0 or 1 for no padding.
+        /// throw `AlignmentException` if it is not a power of 2
+        Zip & data_alignment(u16 alignment)
+        {
+            ensure<WritingState::Writing>::check(_state);
+            AlignmentException::check(alignment);
+            _data_alignment = alignment;
+            return *this;
+        }
+
+        u64 buffer_length() const noexcept
+        {
+            return _buffer_length;
+        }
+        /// @brief set the length of the internal buffers: the buffer for the data of files, and the staging area
+        /// where headers and data are coalesced into large writes. They are aligned to `alignment` (a power of 2,
+        /// like 2MiB for huge pages), and the length is rounded up to it. Cannot be changed while a file is writing.
+        Zip & buffer_length(u64 length, u64 alignment = BUFFER_ALIGNMENT);
+
+        u64 central_spill() const noexcept
+        {
+            return _spill_threshold;
+        }
+        /// @brief keep the memory bounded for a huge number of files: the central directory headers are moved
+        /// into a temporary file when they are over `threshold` bytes, and copied back when closing
+        Zip & central_spill(u64 threshold = CENTRAL_SPILL)
+        {
+            ensure<WritingState::Writing>::check(_state);
+            _spill_threshold = threshold;
+            return *this;
+        }
+
+        u64 patch_batch() const noexcept
+        {
+            return _patch_batch;
+        }
+        /// @brief the local headers are updated after writing data, these patches are collected and written
+        /// into sink in one sorted batch after every `entries` files are closed (0 for only when flushing)
+        Zip & patch_batch(u64 entries)
+        {
+            ensure<WritingState::Writing>::check(_state);
+            _patch_batch = entries;
+            if (_patch_batch != 0 && _unpatched >= _patch_batch) { _apply_patches(); }
+            return *this;
+        }
+
+        /// @brief write the staged data and the deferred patches into the sink, and flush the sink
+        Zip & flush()
+        {
+            _flush_staging();
+            _apply_patches();
+            _sink->flush();
+            return *this;
+        }
+
+        bool adaptive_level() const noexcept
+        {
+            return _adaptive;
+        }
+        /// @brief the decisions of the adaptive level controller
+        AdaptiveLevel::Stats const& adaptive_level_stats() const noexcept
+        {
+            return _adaptive_level.stats();
+        }
+        /// @brief adjust the compression level of compressed files at runtime to keep the writing bound by output,
+        /// the level is changed per block or per file, and level 0 stores the following files.
+        /// The output is timed around the sink writes. For bzip2 the level only sets the block size,
+        /// which is a weak control of the speed. It applies to the files started after calling this.
+        Zip & adaptive_level(bool enable = true, u8 min_level = 0, u8 max_level = AdaptiveLevel::MAX_LEVEL)
+        {
+            ensure_not<WritingState::Closed>::check(_state);
+            _adaptive = enable;
+            _adaptive_level = AdaptiveLevel(min_level, max_level);
+            return *this;
+        }
+
         /// @return return nullptr if no file or zip is closed
         LocalFile * current() noexcept
         {
-            if (_state == WritingState::Closed || _files.empty()) { return nullptr; }
-            return &_files.back();
+            if (_state == WritingState::Closed) { return nullptr; }
+            return _current;
         }
         Zip & close_current();
 
         LocalFile & add(::std::string const& file_name);
 
+        /// @brief handle the writes completed in the sink without waiting, and resume the coroutine waiting for them
+        /// @return true if the coroutine is resumed
+        bool poll()
+        {
+            _sink->poll();
+            if (!_waiting || _sink->writable() < _waiting_length) { return false; }
+            ::std::exchange(_waiting, nullptr).resume();
+            return true;
+        }
+        /// @brief the file descriptor to wait in an event loop before `poll()`, -1 if the sink never waits
+        int event_fd() const
+        {
+            return _sink->event_fd();
+        }
+        /// @brief `close_current()` in coroutine, after the sink can take the writes without waiting
+        Task async_close_current()
+        {
+            co_await _writable();
+            close_current();
+        }
+        /// @brief `close()` in coroutine, the central directory is written after the writes in flight are done
+        Task async_close()
+        {
+            co_await async_close_current();
+            co_await WritableAwaiter{*this, ~static_cast<u64>(0)};
+            close();
+        }
+
         Zip & close()
         {
+            ::std::lock_guard<::std::mutex> lock(_mutex);
             if (_state == WritingState::Closed) { return *this; }
 
             close_current();
             _state = WritingState::Closed;
             auto [cd_size, cd_offset] = _write_central_direction();
-            if (_files.size() >= 0xFFFF
+            if (_entries >= 0xFFFF
              || cd_size       >= 0xFFFFFFFF
              || cd_offset     >= 0xFFFFFFFF
             ) {
@@ -1509,14 +3858,17 @@ namespace nyaszip
                 _write_zip64_locator(record_offset);
             }
             _write_end_of_central_direction(cd_size, cd_offset);
+            flush();
 
             return *this;
         }
     };
 
-    class LocalFile
+    /// @brief a file in zip, also a `streambuf` whose put area is the buffer of zip
+    class LocalFile : public ::std::streambuf
     {
         friend class Zip;
+        friend class StagedZip;
     public:
         class SizeOverflowException : public exception
         {
@@ -1542,6 +3894,21 @@ namespace nyaszip
             }
         };
 
+        class SizeMismatchException : public exception
+        {
+        public:
+            u64 expected_size;
+            u64 size;
+
+            SizeMismatchException(u64 expected, u64 size_)
+            : expected_size(expected), size(size_) {}
+
+            virtual char const* what() const noexcept override
+            {
+                return "the size of written data does not match the expected size of LocalFile";
+            }
+        };
+
         class InvalidFileNameException : public exception
         {
         public:
@@ -1564,6 +3931,24 @@ namespace nyaszip
             return (idx == ::std::string::npos) ? "" : res.substr(idx, res.length() - idx);
         }
 
+        /// @brief the result of sampling the data before compression
+        struct Sampling
+        {
+            u64 length;     // the length of sampled data, 0 if not sampled
+            float entropy;  // shannon entropy of bytes in the sample, in bits per byte
+            float ratio;    // compressed length / sample length of the trial compression, 1 if not tried
+            bool stored;    // the compression is dropped and the file is stored
+        };
+
+        /// @brief the length of data sampled before compression
+        static constexpr u64 SAMPLE_LENGTH = 64 * 1024;     // 64KiB
+        /// @brief the compressed data is assumed to be shorter than the declared size + 1/64 + this, for zip64
+        static constexpr u64 ZIP64_MARGIN = 1024 * 1024;    // 1MiB
+        /// @brief store the file if the entropy of the sample is not smaller than this, no trial compression
+        static constexpr float STORE_ENTROPY = 7.9f;
+        /// @brief store the file if the trial compression ratio is not smaller than this
+        static constexpr float STORE_RATIO = 0.95f;
+
         class GeneralPurposeBitFlag
         {
         public:
@@ -1579,7 +3964,8 @@ namespace nyaszip
         u64 _offset;    // the local file header offset from zip start
 
         WritingState _state;
-        bool _zip64;
+        bool _zip64;            // the local header has the zip64 extra field
+        bool _zip64_auto;       // not declared by `zip64(bool)`, decided when starting
         u16 _cmpr_version;
         AbstractCompression * _cmpr;
         u8 _aes_mode;
@@ -1595,6 +3981,22 @@ namespace nyaszip
         ::std::string _comment;
         u32 _external;
 
+        bool _precompressed;
+        bool _expected;
+        u64 _expected_size;
+        bool _auto_store;
+        bool _sampling;
+        ::std::vector<u8> _sample;
+        Sampling _sampled;
+        u64 _cd_position;   // the central directory header in `Zip::_central`, serialized when closing
+        u64 _cd_length;
+
+        using Pipeline = void (LocalFile::*)(u8 const*, u64);
+        using Finisher = void (LocalFile::*)();
+        Pipeline _pipeline; // selected when starting
+        Finisher _finisher; // selected with `_pipeline`, finishes the compression
+        bool _gather;       // stored without encryption, the segments can be written by one writev
+
         void _init()
         {
             // the offset of LocalFile cannot smaller than that of the zip file
@@ -1602,6 +4004,7 @@ namespace nyaszip
 
             _state = WritingState::Preparing;
             _zip64 = false;
+            _zip64_auto = true;
             _cmpr_version = VersionNeedToExtra::Default;
             _cmpr = nullptr;
             _aes_mode = 0;
@@ -1616,15 +4019,36 @@ namespace nyaszip
             _name = "";
             _comment = "";
             _external = 0;
+
+            _precompressed = false;
+            _expected = false;
+            _expected_size = 0;
+            _auto_store = true;
+            _sampling = false;
+            _sampled = {0, 0, 1, false};
+            _cd_position = 0;
+            _cd_length = 0;
+            _pipeline = nullptr;
+            _finisher = nullptr;
+            _gather = false;
         }
 
         void _rm_cmpr()
         {
-            delete _cmpr;
+            _zip._release_cmpr(_cmpr);
             _cmpr = nullptr;
             _cmpr_method = 0;
             _cmpr_version = VersionNeedToExtra::Default;
         }
+        void _rm_precompressed()
+        {
+            if (!_precompressed) { return; }
+            _precompressed = false;
+            _cmpr_method = 0;
+            _cmpr_version = VersionNeedToExtra::Default;
+            _crc = 0;
+            _uncompressed = 0;
+        }
 
 #ifdef NYASZIP_WARN
         static bool showed_aes_warn;
@@ -1642,22 +4066,23 @@ namespace nyaszip
 #endif
         void _init_aes(u16 bits)
         {
-            delete _aes;
+            _zip._release_aes(_aes);
+            _aes = nullptr;
 
             switch (bits)
             {
             case 128:
-                _aes = new ZipAES<128>;
+                _aes = _zip._acquire_aes<128>();
                 break;
             case 192:
-                _aes = new ZipAES<192>;
+                _aes = _zip._acquire_aes<192>();
                 break;
             case 256:
-                _aes = new ZipAES<256>;
+                _aes = _zip._acquire_aes<256>();
                 break;
             default:
                 _aes_warn();
-                _aes = new ZipAES<256>;
+                _aes = _zip._acquire_aes<256>();
                 break;
             }
             _zip._gen_salt(_aes->salt(), _aes->salt_length());
@@ -1667,7 +4092,7 @@ namespace nyaszip
         }
         void _rm_aes()
         {
-            delete _aes;
+            _zip._release_aes(_aes);
             _aes = nullptr;
             _aes_mode = 0;
             _flag &= ~GeneralPurposeBitFlag::Encrypted;
@@ -1692,143 +4117,420 @@ namespace nyaszip
             u16 res = VersionNeedToExtra::Default;
             if (_external & FileAttributes::VolumeLable)
             {
-                res = VersionNeedToExtra::VolumeLabel;
+                res = VersionNeedToExtra::VolumeLabel;
+            }
+            if (_external & FileAttributes::Directory)
+            {
+                res = VersionNeedToExtra::Directory;
+            }
+            // TODO: File is a patch data set (27)
+            if (_zip64 || (_offset >= 0xFFFFFFFF /* offset is not stored in local header, so the version of local header is not affected by this ? */))
+            {
+                res = VersionNeedToExtra::Zip64;
+            }
+            if (_zip.central_directory_encrypt())
+            {
+                res = VersionNeedToExtra::CDEncryption;
+            }
+            return res;
+        }
+        u16 _version() const noexcept
+        {
+            return ::std::max(_cmpr_version, ::std::max(_enpryption_version(), _functionality_version()));
+        }
+
+        u32 _crc_in_header() const noexcept
+        {
+            return (_flag & GeneralPurposeBitFlag::DataDescriptor) ? 0 : crc();
+        }
+        ::std::tuple<u32, u32> _sizes_in_header() const noexcept // -> (compressed_size, uncompressed_size)
+        {
+            return _sizes_in_header(_compressed, _uncompressed);
+        }
+        ::std::tuple<u32, u32> _sizes_in_header(u64 compressed, u64 uncompressed) const noexcept
+        {
+            u32 cmpr   = static_cast<u32>(compressed);
+            u32 uncmpr = static_cast<u32>(uncompressed);
+            if (_flag & GeneralPurposeBitFlag::DataDescriptor)
+            {
+                cmpr = uncmpr = 0;
+            }
+            if (_zip64)
+            {
+                cmpr = uncmpr = 0xFFFFFFFF;
+            }
+            return {cmpr, uncmpr};
+        }
+
+        /// @brief the local header is final before writing data, when the sizes are declared,
+        /// and crc32 is 0 (AE-2) or given (precompressed)
+        bool _final_header() const noexcept
+        {
+            return _expected && _cmpr == nullptr && (_aes_mode != 0 || _precompressed);
+        }
+        ::std::tuple<u64, u64> _expected_sizes() const noexcept // -> (compressed_size, uncompressed_size)
+        {
+            u64 cmpr = _expected_size;
+            if (_aes != nullptr)
+            {
+                cmpr += _aes->salt_length() + _aes->vari_code_length() + _aes->auth_code_length();
+            }
+            return {cmpr, _precompressed ? _uncompressed : _expected_size};
+        }
+
+        u16 _local_extra_length() const noexcept
+        {
+            u16 len = 0;
+            if (_zip64) { len += 20; }
+            if (_aes_mode != 0) { len += 11; }
+            return len + _alignment_extra_length();
+        }
+        /// @brief the length of the alignment extra field (0xD935, the same as zipalign of android),
+        /// 0 if the file is not stored without encryption or not aligned. At most 6 + 32767 (the alignment is checked
+        /// by `Zip::data_alignment`), so the whole local extra field is still shorter than 65535
+        u16 _alignment_extra_length() const noexcept
+        {
+            u64 alignment = _zip._data_alignment;
+            if (alignment <= 1 || _cmpr != nullptr || _aes_mode != 0 || _precompressed) { return 0; }
+
+            u64 data = _offset + 30 + (_name.size() & 0xFFFF) + (_zip64 ? 20 : 0) + 6;
+            return static_cast<u16>(6 + (alignment - data % alignment) % alignment);
+        }
+        void _write_local_header() const
+        {
+            u16 cmpr_method = _aes_mode != 0 ? 99 : _cmpr_method;
+            u16 file_name_length = _name.size() & 0xFFFF;
+            // the sizes are updated after writing data, or written in the data descriptor
+            auto [compressed, uncompressed] = _final_header() ? _expected_sizes() : ::std::tuple<u64, u64>{0, 0};
+            auto [cmpr, uncmpr] = _sizes_in_header(compressed, uncompressed);
+
+            // not in the buffer of zip, which may hold the data not written yet
+            u8 buffer[30];
+            u8 * header = buffer;
+            _write_into<u32>(header, 0x04034B50);
+            _write_into<u16>(header, _version());
+            _write_into<u16>(header, _flag);
+            _write_into<u16>(header, cmpr_method);
+            _write_into<u16>(header, _modified.time);
+            _write_into<u16>(header, _modified.date);
+            _write_into<u32>(header, _crc_in_header());
+            _write_into<u32>(header, cmpr);
+            _write_into<u32>(header, uncmpr);
+            _write_into<u16>(header, file_name_length);
+            _write_into<u16>(header, _local_extra_length());
+            _zip._write(buffer, header - buffer);
+
+            _zip._write(_name.c_str(), file_name_length);
+            _write_local_extra(compressed, uncompressed);
+        }
+        void _write_local_extra(u64 compressed, u64 uncompressed) const
+        {
+            u8 buffer[20 + 11 + 6];
+            u8 * fields = buffer;
+            if (_zip64)
+            {
+                _write_into<u16>(fields, 0x0001);
+                _write_into<u16>(fields, 0x0010);
+                _write_into<u64>(fields, uncompressed);
+                _write_into<u64>(fields, compressed);
+            }
+            if (_aes_mode != 0)
+            {
+                _write_into<u16>(fields, 0x9901);
+                _write_into<u16>(fields, 0x0007);
+                _write_into<u16>(fields, 0x0002);   // ZIP AE-2
+                _write_into<u16>(fields, 0x4541);   // "AE"
+                _write_into<u8 >(fields, _aes_mode);
+                _write_into<u16>(fields, _cmpr_method);
+            }
+            if (u16 alignment_length = _alignment_extra_length(); alignment_length != 0)
+            {
+                _write_into<u16>(fields, 0xD935);
+                _write_into<u16>(fields, alignment_length - 4);
+                _write_into<u16>(fields, _zip._data_alignment);
+                _zip._write(buffer, fields - buffer);
+
+                // zeros to the alignment
+                for (u64 padding = alignment_length - 6; padding != 0;)
+                {
+                    u64 length = ::std::min(padding, _zip._buffer_length);
+                    ::std::memset(_zip._reserve(length), 0, length);
+                    _zip._commit(length);
+                    padding -= length;
+                }
+                return;
+            }
+            _zip._write(buffer, fields - buffer);
+        }
+
+        /* Writing */
+
+        /// @brief the local header is written and can be patched
+        bool _patchable() const noexcept
+        {
+            return _state != WritingState::Preparing && !_sampling && !_zip._streaming;
+        }
+        /// @brief the local header and the AES start data, deferred until the sampling is done if sampling
+        void _write_headers()
+        {
+            _write_local_header();
+            if (_aes != nullptr) { _write_aes_start_data(); }
+        }
+        void _write_aes_start_data()
+        {
+            _zip._write(_aes->salt(),      _aes->salt_length());
+            _zip._write(_aes->vari_code(), _aes->vari_code_length());
+            _compressed += _aes->salt_length() + _aes->vari_code_length();
+        }
+        void _flush_buffer(u64 length)
+        {
+            (this->*_pipeline)(_zip._buffer, length);
+        }
+        /// @brief write the data in the put area of streambuf, and reset it to empty
+        void _sync_put_area()
+        {
+            u64 length = pptr() - pbase();
+            setp(nullptr, nullptr);
+            if (length != 0)
+            {
+                _flush_buffer(length);
+                SizeOverflowException::check(_zip64, _compressed, _uncompressed);
+            }
+        }
+
+        /* streambuf, the put area is the buffer of zip, so the data is written without copying */
+
+        virtual int_type overflow(int_type ch) override
+        {
+            if (_state == WritingState::Closed) { return traits_type::eof(); }
+            start();
+            _sync_put_area();
+            char * buffer_ = reinterpret_cast<char *>(_zip._buffer);
+            setp(buffer_, buffer_ + _zip._buffer_length);
+            if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+            return traits_type::not_eof(ch);
+        }
+        virtual ::std::streamsize xsputn(char const* data, ::std::streamsize length) override
+        {
+            if (_state == WritingState::Closed) { return 0; }
+            if (pbase() == nullptr) { overflow(traits_type::eof()); }
+            if (length <= epptr() - pptr())
+            {
+                ::std::memcpy(pptr(), data, length);
+                pbump(static_cast<int>(length));
+            }
+            else
+            {
+                // the large data is written from the memory of caller directly
+                write(reinterpret_cast<u8 const*>(data), length);
+            }
+            return length;
+        }
+        virtual int sync() override
+        {
+            if (_state == WritingState::Closed) { return 0; }
+            _sync_put_area();
+            return 0;
+        }
+        /// @brief what is accounted for the data written into the file
+        enum class Checksum : u8
+        {
+            None,       // crc32 & uncompressed size are given in advance (precompressed), or already accounted
+            Length,     // ZIP AE-2 uses the authentication code instead of crc32 to verify the data
+            Crc,
+        };
+        /// @brief the stages (checksum, compression, encryption and the timing of adaptive level) of writing data,
+        /// instantiated for each combination and selected when starting, so there is no branch or virtual call
+        /// of stages per block. `Compression` is `void` for storing, `BZip2Compression` called directly,
+        /// or `AbstractCompression` for the other compressions, called virtually.
+        template<Checksum checksum, typename Compression, u16 aes_bits, bool adaptive> void _pipeline_write(u8 const* data, u64 length)
+        {
+            if constexpr (checksum == Checksum::Crc) { _crc = crc32(_crc, data, length); }
+            if constexpr (checksum != Checksum::None) { _uncompressed += length; }
+
+            if constexpr (::std::is_void_v<Compression>) { _store_data<aes_bits, adaptive>(data, length); }
+            else { _compress_data<Compression, aes_bits, adaptive>(data, length); }
+        }
+        template<Checksum checksum, typename Compression, u16 aes_bits> void _select_stages() noexcept
+        {
+            _pipeline = _zip._adaptive ? &LocalFile::_pipeline_write<checksum, Compression, aes_bits, true>
+                                       : &LocalFile::_pipeline_write<checksum, Compression, aes_bits, false>;
+            _finisher = &LocalFile::_finish_compression<Compression, aes_bits>;
+        }
+        template<Checksum checksum, typename Compression> void _select_pipeline_aes() noexcept
+        {
+            switch (_aes == nullptr ? 0 : _aes->bits())
+            {
+            case 128: return _select_stages<checksum, Compression, 128>();
+            case 192: return _select_stages<checksum, Compression, 192>();
+            case 256: return _select_stages<checksum, Compression, 256>();
+            default:  return _select_stages<checksum, Compression, 0>();
+            }
+        }
+        template<Checksum checksum> void _select_pipeline_cmpr() noexcept
+        {
+            if (_cmpr == nullptr) { _select_pipeline_aes<checksum, void>(); }
+            else if (typeid(*_cmpr) == typeid(BZip2Compression)) { _select_pipeline_aes<checksum, BZip2Compression>(); }
+            else { _select_pipeline_aes<checksum, AbstractCompression>(); }
+        }
+        /// @param accounted the data is already checksumed
+        void _select_pipeline(bool accounted = false) noexcept
+        {
+            _gather = !_sampling && _cmpr == nullptr && _aes == nullptr;
+            if (_sampling)
+            {
+                _pipeline = &LocalFile::_sample_data;
             }
-            if (_external & FileAttributes::Directory)
+            else if (accounted || _precompressed)
             {
-                res = VersionNeedToExtra::Directory;
+                _select_pipeline_cmpr<Checksum::None>();
             }
-            // TODO: File is a patch data set (27)
-            if (_zip64 || (_offset >= 0xFFFFFFFF /* offset is not stored in local header, so the version of local header is not affected by this ? */))
+            else if (_aes_mode != 0)
             {
-                res = VersionNeedToExtra::Zip64;
+                _select_pipeline_cmpr<Checksum::Length>();
             }
-            if (_zip.central_directory_encrypt())
+            else
             {
-                res = VersionNeedToExtra::CDEncryption;
+                _select_pipeline_cmpr<Checksum::Crc>();
             }
-            return res;
         }
-        u16 _version() const noexcept
+        /// @brief the calls of `Compression` are not virtual if it is the final type, and can be inlined
+        template<typename Compression> ::std::tuple<u64, u64> _compress(u8 const* data, u64 length)
         {
-            return ::std::max(_cmpr_version, ::std::max(_enpryption_version(), _functionality_version()));
+            if constexpr (::std::is_same_v<Compression, AbstractCompression>) { return _cmpr->compress(data, length); }
+            else { return static_cast<Compression *>(_cmpr)->Compression::compress(data, length); }
         }
-
-        u32 _crc_in_header() const noexcept
+        template<typename Compression> u64 _finish()
         {
-            return (_flag & GeneralPurposeBitFlag::DataDescriptor) ? 0 : crc();
+            if constexpr (::std::is_same_v<Compression, AbstractCompression>) { return _cmpr->finish(); }
+            else { return static_cast<Compression *>(_cmpr)->Compression::finish(); }
         }
-        ::std::tuple<u32, u32> _sizes_in_header() const noexcept // -> (compressed_size, uncompressed_size)
+        template<u16 aes_bits> void _apply_aes(u8 * data, u64 length)
         {
-            u32 cmpr   = static_cast<u32>(_compressed);
-            u32 uncmpr = static_cast<u32>(_uncompressed);
-            if (_flag & GeneralPurposeBitFlag::DataDescriptor)
-            {
-                cmpr = uncmpr = 0;
-            }
-            if (_zip64)
-            {
-                cmpr = uncmpr = 0xFFFFFFFF;
-            }
-            return {cmpr, uncmpr};
+            // the qualified call is not virtual, and can be inlined
+            if constexpr (aes_bits != 0) { static_cast<ZipAES<aes_bits> *>(_aes)->ZipAES<aes_bits>::apply(data, length); }
         }
-
-        u16 _local_extra_length() const noexcept
+        template<u16 aes_bits> void _apply_aes(u8 * dst, u8 const* src, u64 length)
         {
-            u16 len = 0;
-            if (_zip64) { len += 20; }
-            if (_aes_mode != 0) { len += 11; }
-            return len;
+            static_cast<ZipAES<aes_bits> *>(_aes)->ZipAES<aes_bits>::apply(dst, src, length);
         }
-        void _write_local_header() const
+        void _sample_data(u8 const* data, u64 length)
         {
-            u16 cmpr_method = _aes_mode != 0 ? 99 : _cmpr_method;
-            u16 file_name_length = _name.size() & 0xFFFF;
-            auto [cmpr, uncmpr] = _sizes_in_header();
-
-            u8 * header = _zip._buffer;
-            _write_into<u32>(header, 0x04034B50);
-            _write_into<u16>(header, _version());
-            _write_into<u16>(header, _flag);
-            _write_into<u16>(header, cmpr_method);
-            _write_into<u16>(header, _modified.time);
-            _write_into<u16>(header, _modified.date);
-            _write_into<u32>(header, _crc_in_header());
-            _write_into<u32>(header, cmpr);
-            _write_into<u32>(header, uncmpr);
-            _write_into<u16>(header, file_name_length);
-            _write_into<u16>(header, _local_extra_length());
-            _zip._write_buffer(header);
+            // the rest of data is written after deciding
+            u64 sample_length = ::std::min(length, SAMPLE_LENGTH - _sample.size());
+            if (_aes_mode == 0) { _crc = crc32(_crc, data, sample_length); }
+            _uncompressed += sample_length;
 
-            _zip._write(_name.c_str(), file_name_length);
-            _write_local_extra();
+            _sample.insert(_sample.end(), data, data + sample_length);
+            if (_sample.size() >= SAMPLE_LENGTH)
+            {
+                _end_sampling();
+                if (length != sample_length) { (this->*_pipeline)(data + sample_length, length - sample_length); }
+            }
         }
-        void _write_local_extra() const
+        template<u16 aes_bits, bool adaptive> void _store_data(u8 const* data, u64 length)
         {
-            u8 * fields = _zip._buffer;
-            if (_zip64)
+            _compressed += length;
+
+            if constexpr (aes_bits != 0)
             {
-                _write_into<u16>(fields, 0x0001);
-                _write_into<u16>(fields, 0x0010);
-                _write_into<u64>(fields, _uncompressed);
-                _write_into<u64>(fields, _compressed);
+                // encrypt from the source into the staging area or the sink directly
+                for (u64 chunk = 0; length != 0; data += chunk, length -= chunk)
+                {
+                    chunk = ::std::min(length, _zip._buffer_length);
+                    u8 * dst = _zip._reserve<adaptive>(chunk);
+                    _apply_aes<aes_bits>(dst, data, chunk);
+                    _zip._commit<adaptive>(chunk);
+                }
             }
-            if (_aes_mode != 0)
+            else
             {
-                _write_into<u16>(fields, 0x9901);
-                _write_into<u16>(fields, 0x0007);
-                _write_into<u16>(fields, 0x0002);   // ZIP AE-2
-                _write_into<u16>(fields, 0x4541);   // "AE"
-                _write_into<u8 >(fields, _aes_mode);
-                _write_into<u16>(fields, _cmpr_method);
+                _zip._write<adaptive>(data, length);
             }
-            _zip._write_buffer(fields);
+            if constexpr (adaptive) { _zip._adaptive_level.update(); }
         }
+        template<typename Compression, u16 aes_bits, bool adaptive> void _compress_data(u8 const* data, u64 length)
+        {
+            using clock = ::std::chrono::steady_clock;
 
-        /* Writing */
+            while (length != 0)
+            {
+                clock::time_point t0, t1;
+                if constexpr (adaptive) { t0 = clock::now(); }
+                auto [consumed, cmpr_length] = _compress<Compression>(data, length);
+                if constexpr (adaptive) { t1 = clock::now(); }
+                data += consumed; length -= consumed;
+                _compressed += cmpr_length;
 
-        void _write_aes_start_data()
-        {
-            _zip._write(_aes->salt(),      _aes->salt_length());
-            _zip._write(_aes->vari_code(), _aes->vari_code_length());
-            _compressed += _aes->salt_length() + _aes->vari_code_length();
+                _apply_aes<aes_bits>(_cmpr->buffer(), cmpr_length);
+                _zip._write<adaptive>(_cmpr->buffer(), cmpr_length);
+                if constexpr (adaptive) { _adapt_level(consumed, cmpr_length, t0, t1); }
+            }
         }
-        void _flush_buffer(u64 length)
+        /// @brief feed the timing of a compression to the controller, change the level per block.
+        /// The output is timed by the zip around the sink writes.
+        void _adapt_level(u64 input, u64 output, ::std::chrono::steady_clock::time_point t0,
+                         ::std::chrono::steady_clock::time_point t1)
         {
-            if (_aes_mode != 0)
-            {
-                // use the authentication code to verify the correctness of the encrypted data in ZIP AE-2,
-                // instead of using crc32 to verify the correctness of the un-encrypted data
-            }
-            else
+            AdaptiveLevel & controller = _zip._adaptive_level;
+            controller.compressed(input, output, ::std::chrono::duration<double>(t1 - t0).count());
+            if (controller.update())
             {
-                _crc = crc32(_crc, _zip._buffer, length);
+                // cannot store the rest of a compressed file, level 0 applies to the following files
+                _cmpr->level(::std::max(controller.level(), static_cast<u8>(1)));
             }
-            _uncompressed += length;
+        }
+        /// @brief decide to compress or store the file by the sample, then write the sample
+        void _end_sampling()
+        {
+            _sampling = false;
+            u64 const length = ::std::min(static_cast<u64>(_sample.size()), SAMPLE_LENGTH);
+            _sampled = {length, 0, 1, false};
 
-            if (_cmpr == nullptr)
+            if (length != 0)
             {
-                _compressed += length;
+                u64 histogram[256] = {0};
+                for (u64 i = 0; i < length; i++) { histogram[_sample[i]]++; }
+                double entropy = 0;
+                for (u64 count : histogram)
+                {
+                    if (count == 0) { continue; }
+                    double p = static_cast<double>(count) / length;
+                    entropy -= p * ::std::log2(p);
+                }
+                _sampled.entropy = static_cast<float>(entropy);
 
-                if (_aes != nullptr)
+                if (_sampled.entropy < STORE_ENTROPY)
                 {
-                    _aes->apply(_zip._buffer, length);
+                    _sampled.ratio = static_cast<float>(_cmpr->estimate(_sample.data(), length)) / length;
                 }
-                _zip._write_buffer(length);
             }
-            else
+            if (_sampled.entropy >= STORE_ENTROPY || _sampled.ratio >= STORE_RATIO)
             {
-                u8 * buffer_ptr = _zip._buffer;
-                while (length != 0)
+                // the local header is not written yet, so it has the final method
+                _sampled.stored = true;
+                _rm_cmpr();
+            }
+
+            _write_headers();
+            _select_pipeline(true);
+            (this->*_pipeline)(_sample.data(), _sample.size());
+            ::std::vector<u8>().swap(_sample);
+            _select_pipeline();
+        }
+        template<typename Compression, u16 aes_bits> void _finish_compression()
+        {
+            if constexpr (!::std::is_void_v<Compression>)
+            {
+                while (u64 cmpr_length = _finish<Compression>())
                 {
-                    auto [consumed, cmpr_length] = _cmpr->compress(buffer_ptr, length);
-                    buffer_ptr += consumed; length -= consumed;
                     _compressed += cmpr_length;
 
-                    if (_aes != nullptr)
-                    {
-                        _aes->apply(_cmpr->buffer(), cmpr_length);
-                    }
+                    _apply_aes<aes_bits>(_cmpr->buffer(), cmpr_length);
                     _zip._write(_cmpr->buffer(), cmpr_length);
                 }
             }
@@ -1842,19 +4544,15 @@ namespace nyaszip
 
         /* Writing => Closed */
 
-        void _update_local_header() const
+        void _update_local_header()
         {
-            auto pos = _zip._tellp();
-
             /* update static local header */
             u8 * tmp = _zip._buffer;
             auto [cmpr, uncmpr] = _sizes_in_header();
             _write_into<u32>(tmp, _crc_in_header());
             _write_into<u32>(tmp, cmpr);
             _write_into<u32>(tmp, uncmpr);
-
-            _zip._seekp(_offset + 14);
-            _zip._write_buffer(tmp);
+            _zip._pwrite_buffer(tmp, _offset + 14);
 
             /* update zip64 extra field */
             if (_zip64)
@@ -1864,11 +4562,8 @@ namespace nyaszip
                 _write_into<u64>(tmp, _compressed);
 
                 u16 file_name_length = _name.size() & 0xFFFF;
-                _zip._seekp(_offset + 34 + file_name_length);
-                _zip._write_buffer(tmp);
+                _zip._pwrite_buffer(tmp, _offset + 34 + file_name_length);
             }
-
-            _zip._seekp(pos);
         }
         void _write_data_descriptor() const
         {
@@ -1907,16 +4602,22 @@ namespace nyaszip
             if (_aes_mode != 0) { len += 11; }
             return len;
         }
-        void _write_cd_header() const
+        u64 _cd_header_length() const
+        {
+            return 46 + (_name.size() & 0xFFFF) + _central_extra_length() + (_comment.size() & 0xFFFF);
+        }
+        /// @brief serialize the central directory header into `header`, `_cd_header_length()` bytes
+        void _write_cd_header(u8 * header) const
         {
             u16 cmpr_method = _aes_mode != 0 ? 99 : _cmpr_method;
             u16 file_name_length = _name.size() & 0xFFFF;
             u16 comment_length = _comment.size() & 0xFFFF;
             /* zip64 */
             u32 offs_  = ::std::min(static_cast<u64>(0xFFFFFFFF), _offset);
-            auto [cmpr, uncmpr] = _sizes_in_header();
+            // the real values, the larger ones are in zip64 extra field
+            u32 cmpr   = static_cast<u32>(::std::min(static_cast<u64>(0xFFFFFFFF), _compressed));
+            u32 uncmpr = static_cast<u32>(::std::min(static_cast<u64>(0xFFFFFFFF), _uncompressed));
 
-            u8 * header = _zip._buffer;
             _write_into<u32>(header, 0x02014B50);
             _write_into<u16>(header, VersionMadeOf);
             _write_into<u16>(header, _version());
@@ -1924,7 +4625,7 @@ namespace nyaszip
             _write_into<u16>(header, cmpr_method);
             _write_into<u16>(header, _modified.time);
             _write_into<u16>(header, _modified.date);
-            _write_into<u32>(header, _crc_in_header());
+            _write_into<u32>(header, crc());
             _write_into<u32>(header, cmpr);
             _write_into<u32>(header, uncmpr);
             _write_into<u16>(header, file_name_length);
@@ -1934,38 +4635,23 @@ namespace nyaszip
             _write_into<u16>(header, 0 /* internal file attributes */);
             _write_into<u32>(header, _external);
             _write_into<u32>(header, offs_);
-            _zip._write_buffer(header);
 
-            _zip._write(_name.c_str(), file_name_length);
-            _write_central_extra();
-            _zip._write(_comment.c_str(), comment_length);
+            ::std::memcpy(header, _name.c_str(), file_name_length);
+            header += file_name_length;
+            _write_central_extra(header);
+            ::std::memcpy(header, _comment.c_str(), comment_length);
         }
-        void _write_central_extra() const
+        void _write_central_extra(u8 * & fields) const
         {
-            u8 * fields = _zip._buffer;
             //if (_zip64)  must use zip64 format if offset is greater than 0xFFFFFFFE
+            // nothing need to store in zip64 field if the data size is 0, drop
+            if (u16 z64_length = _central_extra_length() - (_aes_mode != 0 ? 11 : 0); z64_length != 0)
             {
-                u16 * counter = reinterpret_cast<u16 *>(fields + 2);
-
                 _write_into<u16>(fields, 0x0001);
-                _write_into<u16>(fields, 0 /* counter */);
-                if (_uncompressed >= 0xFFFFFFFF) {
-                    _write_into<u64>(fields, _uncompressed);
-                    *counter += sizeof(u64);
-                }
-                if (_compressed >= 0xFFFFFFFF) {
-                    _write_into<u64>(fields, _compressed);
-                    *counter += sizeof(u64);
-                }
-                if (_offset >= 0xFFFFFFFF) {
-                    _write_into<u64>(fields, _offset);
-                    *counter += sizeof(u64);
-                }
-                if (*counter == 0)
-                {
-                    // nothing need to store in zip64 field, drop
-                    fields = _zip._buffer;
-                }
+                _write_into<u16>(fields, z64_length - 4);
+                if (_uncompressed >= 0xFFFFFFFF) { _write_into<u64>(fields, _uncompressed); }
+                if (_compressed   >= 0xFFFFFFFF) { _write_into<u64>(fields, _compressed); }
+                if (_offset       >= 0xFFFFFFFF) { _write_into<u64>(fields, _offset); }
             }
             if (_aes_mode != 0)
             {
@@ -1976,7 +4662,26 @@ namespace nyaszip
                 _write_into<u8 >(fields, _aes_mode);
                 _write_into<u16>(fields, _cmpr_method);
             }
-            _zip._write_buffer(fields);
+        }
+        /// @brief append the central directory header to `zip` (the zip of this file when closing)
+        void _append_cd_header(Zip & zip)
+        {
+            auto & central = zip._central;
+            _cd_position = central.size();
+            _cd_length = _cd_header_length();
+            central.resize(_cd_position + _cd_length);
+            _write_cd_header(central.data() + _cd_position);
+        }
+        /// @brief serialize the central directory header again if the file is changed after closing
+        void _update_cd_header()
+        {
+            if (_state != WritingState::Closed) { return; }
+
+            // this is the last header, since the file is released when adding the next one
+            auto & central = _zip._central;
+            _cd_length = _cd_header_length();
+            central.resize(_cd_position + _cd_length);
+            _write_cd_header(central.data() + _cd_position);
         }
 
     public:
@@ -1987,8 +4692,8 @@ namespace nyaszip
 
         ~LocalFile()
         {
-            delete _cmpr;
-            delete _aes;
+            _zip._release_cmpr(_cmpr);
+            _zip._release_aes(_aes);
         }
 
         Zip & zip() noexcept
@@ -2051,12 +4756,28 @@ namespace nyaszip
         {
             return _external;
         }
+        bool auto_store() const noexcept
+        {
+            return _auto_store;
+        }
+        bool precompressed() const noexcept
+        {
+            return _precompressed;
+        }
+        /// @brief the result of sampling, only determined after the sample is full or the file is closed
+        Sampling const& sampling() const noexcept
+        {
+            return _sampled;
+        }
 
-        /// @brief set the file enable zip64 format or not, will throw error if not enble (default) and write in more than 4GB data
+        /// @brief declare the file is in zip64 format or not, will throw error if not enable and write in more than 4GB data.
+        /// if not declared, it is decided by `expected_size`, or the zip64 extra field is written in the local header
+        /// for the unknown sizes (20 bytes, kept even if the sizes are small)
         LocalFile & zip64(bool enable = true)
         {
             ensure<WritingState::Preparing>::check(_state);
             _zip64 = enable;
+            _zip64_auto = false;
             return *this;
         }
         LocalFile & name(::std::string const& name_)
@@ -2078,6 +4799,7 @@ namespace nyaszip
         {
             ensure_not<WritingState::Closed>::check(_zip.state());
             _comment = comment_;
+            _update_cd_header();
             return *this;
         }
         /// @brief indicates that the file name & comment are utf-8 encoded
@@ -2092,14 +4814,12 @@ namespace nyaszip
             {
                 _flag &= ~GeneralPurposeBitFlag::Utf8;
             }
-            // update local file header
-            if (_state != WritingState::Preparing)
+            // update local file header, only in the central directory if streaming
+            if (_patchable())
             {
-                auto pos = _zip._tellp();
-                _zip._seekp(_offset + 6);
-                _zip._write(&_flag, sizeof(u16));
-                _zip._seekp(pos);
+                _zip._pwrite(&_flag, sizeof(u16), _offset + 6);
             }
+            _update_cd_header();
             return *this;
         }
         /// @brief change the last modifird time
@@ -2107,15 +4827,13 @@ namespace nyaszip
         {
             ensure_not<WritingState::Closed>::check(_zip.state());
             _modified = modified_;
-            // update local file header
-            if (_state != WritingState::Preparing)
+            // update local file header, only in the central directory if streaming
+            if (_patchable())
             {
-                auto pos = _zip._tellp();
-                _zip._seekp(_offset + 10);
-                _zip._write(&_modified.time, sizeof(u16));
-                _zip._write(&_modified.date, sizeof(u16));
-                _zip._seekp(pos);
+                _zip._pwrite(&_modified.time, sizeof(u16), _offset + 10);
+                _zip._pwrite(&_modified.date, sizeof(u16), _offset + 12);
             }
+            _update_cd_header();
             return *this;
         }
         /// @brief change the external attribute, i.e., file attribute in the file system
@@ -2126,6 +4844,7 @@ namespace nyaszip
             // may split this into smaller methods?
             ensure_not<WritingState::Closed>::check(_zip.state());
             _external = exter;
+            _update_cd_header();
             return *this;
         }
 
@@ -2153,13 +4872,119 @@ namespace nyaszip
             return *this;
         }
 
+        // clear the compression, store the file
+        LocalFile & compression(nullptr_t)
+        {
+            ensure<WritingState::Preparing>::check(_state);
+            _rm_precompressed();
+            _rm_cmpr();
+            return *this;
+        }
+        /// @brief set the compression, the LocalFile takes the ownership of `cmpr`
+        LocalFile & compression(AbstractCompression * cmpr)
+        {
+            ensure<WritingState::Preparing>::check(_state);
+            _rm_precompressed();
+            _rm_cmpr();
+            if (cmpr != nullptr)
+            {
+                _cmpr = cmpr;
+                _cmpr_method = _cmpr->method();
+                _cmpr_version = _cmpr->version();
+            }
+            return *this;
+        }
+        /// @brief sample the beginning of the file (enable by default), and store the file instead if
+        /// the sample seems incompressible, judging by the entropy of bytes and a trial compression.
+        LocalFile & auto_store(bool enable = true)
+        {
+            ensure<WritingState::Preparing>::check(_state);
+            _auto_store = enable;
+            return *this;
+        }
+        /// @brief declare the length of data that will be written into the file. For stored encrypted files and
+        /// precompressed files, the local header is final before writing, and is not updated after writing,
+        /// so the zip is written sequentially (set `modified` and `utf8` before starting as well).
+        /// `close()` throws `SizeMismatchException` if the written length is different, after updating the header.
+        LocalFile & expected_size(u64 size)
+        {
+            ensure<WritingState::Preparing>::check(_state);
+            _expected = true;
+            _expected_size = size;
+            return *this;
+        }
+        bool has_expected_size() const noexcept
+        {
+            return _expected;
+        }
+        u64 expected_size() const noexcept
+        {
+            return _expected_size;
+        }
+
+        /// @brief compress the file using bzip2
+        /// @param level block size in 100k, [1, 9]
+        /// @param threads the number of blocks compressed concurrently, 0 for the number of cpu cores
+        LocalFile & bzip2(u8 level = 9, u32 threads = 0)
+        {
+            ensure<WritingState::Preparing>::check(_state);
+            return compression(_zip._acquire_bzip2(level, threads));
+        }
+        /// @brief the data written into the file is already compressed (e.g. a raw deflate stream taken
+        /// from a gzip member), it is copied into the zip as is without recompression, but still encrypted.
+        /// @param method compression method of the data, 8 for deflate
+        /// @param crc crc-32 of the uncompressed data
+        /// @param uncompressed_size the length of the uncompressed data
+        /// @param version the version needed to extract the data, 20 for deflate
+        LocalFile & precompressed(u16 method, u32 crc, u64 uncompressed_size, u16 version = VersionNeedToExtra::Deflate)
+        {
+            ensure<WritingState::Preparing>::check(_state);
+            _rm_cmpr();
+            _precompressed = true;
+            _cmpr_method = method;
+            _cmpr_version = version;
+            _crc = crc;
+            _uncompressed = uncompressed_size;
+            return *this;
+        }
+
         LocalFile & start()
         {
             if (_state != WritingState::Preparing) { return *this; }
 
-            _write_local_header();
+            if (_cmpr != nullptr && _zip._adaptive)
+            {
+                if (u8 level = _zip._adaptive_level.level(); level == 0)
+                {
+                    _zip._adaptive_level.stored();
+                    _rm_cmpr();
+                }
+                else
+                {
+                    _cmpr->level(level);
+                }
+            }
+            if (_zip64_auto)
+            {
+                // decided by the declared sizes, or always written for the unknown sizes
+                auto [cmpr, uncmpr] = _expected_sizes();
+                if (_cmpr != nullptr) { cmpr = uncmpr + uncmpr / 64 + ZIP64_MARGIN; }   // may be a little larger
+                _zip64 = !_expected || ::std::max(cmpr, uncmpr) >= 0xFFFFFFFF;
+            }
+            if (_final_header())
+            {
+                auto [cmpr, uncmpr] = _expected_sizes();
+                SizeOverflowException::check(_zip64, cmpr, uncmpr);
+            }
+            else if (_zip._streaming)
+            {
+                _flag |= GeneralPurposeBitFlag::DataDescriptor;
+            }
+
             _state = WritingState::Writing;
-            if (_aes != nullptr) { _write_aes_start_data(); }
+            _sampling = _auto_store && _cmpr != nullptr;
+            _select_pipeline();
+            if (!_sampling) { _write_headers(); }
 
             return *this;
         }
@@ -2169,11 +4994,12 @@ namespace nyaszip
             // Zip & LocalFile are share the same buffer,
             // must write local header first before writing data into LocalFile
             start();
+            _sync_put_area();
             return _zip._buffer;
         }
-        static constexpr u64 buffer_length() noexcept
+        u64 buffer_length() const noexcept
         {
-            return Zip::BUFFER_LENGTH;
+            return _zip._buffer_length;
         }
         LocalFile & flush_buff(u64 length)
         {
@@ -2188,12 +5014,46 @@ namespace nyaszip
         {
             start();
             ensure_not<WritingState::Closed>::check(_state);
-            while (length != 0)
+            _sync_put_area();
+            // from the memory of caller directly, without copying into the buffer
+            (this->*_pipeline)(data, length);
+            SizeOverflowException::check(_zip64, _compressed, _uncompressed);
+            return *this;
+        }
+        /// @brief write the data in the segments in order, the segments are written into the sink by one writev
+        /// if the file is stored without encryption
+        LocalFile & write(::std::span<iovec const> segments)
+        {
+            start();
+            ensure_not<WritingState::Closed>::check(_state);
+            _sync_put_area();
+            if (!_gather)
             {
-                u64 flush_length = ::std::min(length, buffer_length());
-                ::std::memcpy(buffer(), data, flush_length);
-                _flush_buffer(flush_length);
-                data += flush_length; length -= flush_length;
+                for (iovec const& segment : segments)
+                {
+                    (this->*_pipeline)(static_cast<u8 const*>(segment.iov_base), segment.iov_len);
+                }
+            }
+            else
+            {
+                u64 length = 0;
+                for (iovec const& segment : segments)
+                {
+                    if (!_precompressed) { _crc = crc32(_crc, static_cast<u8 const*>(segment.iov_base), segment.iov_len); }
+                    length += segment.iov_len;
+                }
+                if (!_precompressed) { _uncompressed += length; }
+                _compressed += length;
+
+                if (_zip._adaptive)
+                {
+                    _zip._writev<true>(segments.data(), segments.size(), length);
+                    _zip._adaptive_level.update();
+                }
+                else
+                {
+                    _zip._writev(segments.data(), segments.size(), length);
+                }
             }
             SizeOverflowException::check(_zip64, _compressed, _uncompressed);
             return *this;
@@ -2206,24 +5066,121 @@ namespace nyaszip
         LocalFile & close()
         {
             if (_state == WritingState::Closed) { return *this; }
-            if (_state == WritingState::Preparing) {
+            _sync_put_area();
+            bool const empty = _state == WritingState::Preparing;
+            if (empty) {
                 // zero-length file or directory cannot have compression and enpryption
                 _zip64 = false;
+                    _rm_precompressed();
                 _rm_cmpr();
                 _rm_aes();
                 _write_local_header();
             }
 
+            if (_sampling) { _end_sampling(); }
+            if (_cmpr != nullptr) { (this->*_finisher)(); }
             if (_aes != nullptr) { _write_aes_end_data(); }
             _state = WritingState::Closed;
-            _update_local_header();
+
+            bool const final_header = _final_header();
+            auto const [expected_cmpr, expected_uncmpr] = _expected_sizes();
+            u64 const written = _precompressed ? _compressed - (expected_cmpr - _expected_size) : _uncompressed;
+            bool const mismatch = _expected && written != _expected_size;
+            bool const described = _flag & GeneralPurposeBitFlag::DataDescriptor;
+            if (!empty && !described && (!final_header || (mismatch && !_zip._streaming)))
+            {
+                _update_local_header();
+            }
             _write_data_descriptor();
+            _append_cd_header(_zip);
+            _zip._entry_closed();
 
-            delete _cmpr;
-            delete _aes;
+            _zip._release_cmpr(_cmpr);
+            _zip._release_aes(_aes);
             _cmpr = nullptr;
             _aes = nullptr;
 
+            if (mismatch)
+            {
+                throw SizeMismatchException(_expected_size, written);
+            }
+            return *this;
+        }
+
+        /// @brief `write` in coroutine, each `buffer_length()` bytes are written after the sink can take them
+        /// without waiting (see `Zip::poll`), `data` must be alive until the task is done
+        Task async_write(u8 const* data, u64 length)
+        {
+            while (length != 0)
+            {
+                u64 chunk = ::std::min(length, _zip._buffer_length);
+                co_await _zip._writable();
+                write(data, chunk);
+                data += chunk; length -= chunk;
+            }
+        }
+        /// @brief `close` in coroutine, after the sink can take the writes without waiting
+        Task async_close()
+        {
+            co_await _zip._writable();
+            close();
+        }
+    };
+
+    /// @brief write files in a thread concurrently with other threads: the files are written into a private zip
+    /// writer (with the private buffers and staging sink in memory, spilled into a temporary file if too long),
+    /// and appended into the shared zip in the order of completion by `commit()`.
+    class StagedZip
+    {
+    public:
+        static constexpr u64 BUFFER_LENGTH = 64 * 1024;         // 64KiB
+        static constexpr u64 SPILL_LENGTH = 64 * 1024 * 1024;   // 64MiB
+
+    protected:
+        Zip & _zip;
+        StagingSink _sink;
+        Zip _staging;
+
+        StagedZip(StagedZip const&) = delete;
+        StagedZip & operator =(StagedZip const&) = delete;
+
+    public:
+        /// @param spill_length the length of staged data in memory before spilling, 0 for never spilling
+        /// @param buffer_length the length of the private buffers, see `Zip::buffer_length`
+        StagedZip(Zip & zip_, u64 spill_length = SPILL_LENGTH, u64 buffer_length = BUFFER_LENGTH)
+        : _zip(zip_), _sink(spill_length), _staging(_sink, false) {
+            _staging.buffer_length(buffer_length);
+            // the salts must not repeat in the zip
+            u64 seed;
+            {
+                ::std::lock_guard<::std::mutex> lock(_zip._mutex);
+                _zip._gen_salt(reinterpret_cast<u8 *>(&seed), sizeof(seed));
+            }
+            _staging._random.seed(seed);
+        }
+
+        Zip & zip() noexcept
+        {
+            return _zip;
+        }
+        /// @return the file not committed yet, nullptr if none
+        LocalFile * current() noexcept
+        {
+            return _staging._current;
+        }
+
+        /// @brief add a file, the previous file is committed
+        LocalFile & add(::std::string const& file_name)
+        {
+            commit();
+            return _staging.add(file_name);
+        }
+        /// @brief close the current file and append it into the zip, thread-safe
+        StagedZip & commit()
+        {
+            if (_staging._current == nullptr) { return *this; }
+            _staging.close_current();
+            _zip._commit_staged(_staging, _sink);
             return *this;
         }
     };
@@ -2234,26 +5191,140 @@ namespace nyaszip
 
     Zip::~Zip()
     {
-        _files.clear();
-        delete _buffer;
-        if (_owned_output)
-        {
-            _output->flush();
-            delete _output;
+        delete _current;
+        for (AbstractZipAES * aes : _aes_pool) { delete aes; }
+        delete _cmpr_pool;
+        if (_spill != nullptr) { ::std::fclose(_spill); }
+        _flush_staging();
+        _apply_patches();
+        _deallocate(_buffer, _buffer_alignment);
+        _deallocate(_staging, _buffer_alignment);
+        if (_owned_sink)
+        {
+            delete _sink;
         }
     }
     ::std::tuple<u64, u64> Zip::_write_central_direction()
     {
         u64 cd_offset = ::std::bit_cast<u64>(_tellp());
+        u64 cd_size = _spilled + _central.size();
 
-        for (LocalFile const& file : _files)
+        if (_spill != nullptr)
         {
-            file._write_cd_header();
+            CentralSpillException::check(::std::fflush(_spill) == 0);
+            ::std::rewind(_spill);
+            for (u64 remain = _spilled; remain != 0;)
+            {
+                u64 length = ::std::fread(_buffer, 1, ::std::min(remain, _buffer_length), _spill);
+                CentralSpillException::check(length != 0);
+                _write_buffer(length);
+                remain -= length;
+            }
+            ::std::fclose(_spill);
+            _spill = nullptr;
         }
-
-        u64 cd_size = ::std::bit_cast<u64>(_tellp()) - cd_offset;
+        // the headers are serialized when the files are closed
+        _write(_central.data(), _central.size());
+        ::std::vector<u8>().swap(_central);
         return {cd_size, cd_offset};
     }
+    Zip & Zip::buffer_length(u64 length, u64 alignment)
+    {
+        ensure<WritingState::Writing>::check(_state);
+        if (auto curr = current(); curr != nullptr)
+        {
+            ensure_not<WritingState::Writing>::check(curr->state());
+        }
+        alignment = ::std::bit_ceil(::std::max(alignment, static_cast<u64>(1)));
+        length = (::std::max(length, MIN_BUFFER_LENGTH) + alignment - 1) & ~(alignment - 1);
+
+        _flush_staging();
+        u8 * buffer = _allocate(length, alignment);
+        u8 * staging = _allocate(length, alignment);
+        _deallocate(_buffer, _buffer_alignment);
+        _deallocate(_staging, _buffer_alignment);
+        _buffer = buffer;
+        _staging = staging;
+        _buffer_length = length;
+        _buffer_alignment = alignment;
+        return *this;
+    }
+    void Zip::_commit_staged(Zip & staging, StagingSink & sink)
+    {
+        LocalFile * file = staging._current;
+        staging.flush();
+        StagingException::check(sink.good());
+        {
+            ::std::lock_guard<::std::mutex> lock(_mutex);
+            ensure<WritingState::Writing>::check(_state);
+            // release the current file of this zip, its central directory header cannot be updated after this one
+            close_current();
+            delete _current;
+            _current = nullptr;
+            _spill_central();
+
+            u64 offset = ::std::bit_cast<u64>(_tellp());
+            u64 position = 0;   // the staged data before is written
+            if (_data_alignment > 1 && file->_cmpr_method == 0 && file->_aes_mode == 0 && !file->_precompressed)
+            {
+                // the offset is known only now, rebuild the local extra field with one alignment extra field
+                u8 fixed[30];
+                StagingException::check(sink.read(fixed, sizeof(fixed), 0));
+                u16 name_length, extra_length;
+                ::std::memcpy(&name_length, fixed + 26, sizeof(u16));
+                ::std::memcpy(&extra_length, fixed + 28, sizeof(u16));
+                position = 30 + name_length + extra_length;
+
+                ::std::vector<u8> header(position + 6 + _data_alignment);
+                StagingException::check(sink.read(header.data(), position, 0));
+                // keep the other fields, drop an alignment field already there
+                u64 kept = 30 + name_length;
+                for (u64 field = kept; field + 4 <= position;)
+                {
+                    u16 id, length;
+                    ::std::memcpy(&id, header.data() + field, sizeof(u16));
+                    ::std::memcpy(&length, header.data() + field + 2, sizeof(u16));
+                    u64 field_length = ::std::min(4 + static_cast<u64>(length), position - field);
+                    if (id != 0xD935)
+                    {
+                        ::std::memmove(header.data() + kept, header.data() + field, field_length);
+                        kept += field_length;
+                    }
+                    field += field_length;
+                }
+                u64 padding = (_data_alignment - (offset + kept + 6) % _data_alignment) % _data_alignment;
+                u8 * field = header.data() + kept;
+                _write_into<u16>(field, 0xD935);
+                _write_into<u16>(field, static_cast<u16>(2 + padding));
+                _write_into<u16>(field, _data_alignment);
+                ::std::memset(field, 0, padding);
+                u8 * length_field = header.data() + 28;
+                _write_into<u16>(length_field, static_cast<u16>(kept - 30 - name_length + 6 + padding));
+                _write(header.data(), kept + 6 + padding);
+            }
+            for (; position < sink.spilled();)
+            {
+                u64 length = ::std::min(sink.spilled() - position, _buffer_length);
+                StagingException::check(sink.read(_buffer, length, position));
+                _write_buffer(length);
+                position += length;
+            }
+            u64 in_memory = position - sink.spilled();
+            _write(sink.data().data() + in_memory, sink.data().size() - in_memory);
+
+            // relocate the file into this zip
+            file->_offset = offset;
+            file->_append_cd_header(*this);
+            _entries++;
+            _entry_closed();
+        }
+
+        delete staging._current;
+        staging._current = nullptr;
+        staging._entries = 0;
+        staging._central.clear();
+        sink.clear();
+    }
     Zip & Zip::close_current()
     {
         auto curr = current();
@@ -2265,12 +5336,15 @@ namespace nyaszip
         ensure<WritingState::Writing>::check(_state);
         close_current();
 
-        _files.emplace_back(*this);
-
-        LocalFile & local_file = _files.back();
-        local_file.name(file_name);
+        // the closed file is already serialized into the central directory
+        delete _current;
+        _current = nullptr;
+        _spill_central();
+        _current = new LocalFile(*this);
+        _entries++;
 
-        return local_file;
+        _current->name(file_name);
+        return *_current;
     }
 
 }   // namespace nyaszip
\ No newline at end of file